@@ -0,0 +1,182 @@
+// obf-synth: writes synthetic IR modules of a chosen shape for the scaling
+// benchmark, and measures the size of existing ones.
+//
+//   obf-synth -functions=1000 -blocks=16 -strings=1000 -loop-depth=2 -o m.bc
+//   obf-synth -measure m.bc
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Support/raw_ostream.h"
+#include <random>
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<unsigned> NumFunctions("functions", cl::init(100),
+                                      cl::desc("Number of functions"));
+static cl::opt<unsigned> BlocksPerFunction(
+    "blocks", cl::init(8),
+    cl::desc("Straight-line/diamond blocks in each function's loop body"));
+static cl::opt<unsigned> NumStrings("strings", cl::init(100),
+                                    cl::desc("Number of str.* C strings"));
+static cl::opt<unsigned> StringLength(
+    "string-length", cl::init(0),
+    cl::desc("Pad each string to this many characters (0 = short strings)"));
+static cl::opt<unsigned> LoopDepth("loop-depth", cl::init(1),
+                                   cl::desc("Loop nest depth per function"));
+static cl::opt<unsigned> Seed("seed", cl::init(1),
+                              cl::desc("Seed for constants and branches"));
+static cl::opt<std::string> OutputFilename("o", cl::init("-"),
+                                           cl::desc("Output bitcode file"));
+static cl::opt<std::string>
+    MeasureFile("measure", cl::desc("Print the size of this IR file as JSON "
+                                    "instead of generating a module"));
+
+// One function: an alloca'd accumulator, a LoopDepth-deep nest of counted
+// loops with PHI induction variables, and Blocks blocks in the innermost
+// body that either fall through or skip the next block.
+static void buildFunction(Module &M, unsigned Index,
+                          ArrayRef<GlobalVariable *> Strings,
+                          FunctionCallee Puts, std::mt19937 &RNG) {
+  LLVMContext &C = M.getContext();
+  Type *I32 = Type::getInt32Ty(C);
+  Function *F = Function::Create(FunctionType::get(I32, {I32}, false),
+                                 GlobalValue::ExternalLinkage,
+                                 formatv("f{0}", Index).str(), M);
+  Value *X = F->getArg(0);
+
+  BasicBlock *Entry = BasicBlock::Create(C, "entry", F);
+  IRBuilder<> B(Entry);
+  AllocaInst *Acc = B.CreateAlloca(I32, nullptr, "acc");
+  B.CreateStore(X, Acc);
+  if (!Strings.empty())
+    B.CreateCall(Puts, {Strings[Index % Strings.size()]});
+
+  // Loop headers, outermost first; each one counts its PHI up to a small
+  // trip count.
+  std::vector<PHINode *> IVs;
+  std::vector<BasicBlock *> Headers;
+  BasicBlock *Pred = Entry;
+  for (unsigned D = 0; D < LoopDepth; ++D) {
+    BasicBlock *Header = BasicBlock::Create(C, formatv("loop{0}", D), F);
+    B.CreateBr(Header);
+    B.SetInsertPoint(Header);
+    PHINode *IV = B.CreatePHI(I32, 2, formatv("i{0}", D));
+    IV->addIncoming(ConstantInt::get(I32, 0), Pred);
+    IVs.push_back(IV);
+    Headers.push_back(Header);
+    Pred = Header;
+  }
+
+  // The body: block I computes, stores and then branches to I+1 or I+2.
+  std::vector<BasicBlock *> Body;
+  for (unsigned I = 0; I < BlocksPerFunction; ++I)
+    Body.push_back(BasicBlock::Create(C, formatv("b{0}", I), F));
+  BasicBlock *Latch = BasicBlock::Create(C, "latch", F);
+  B.CreateBr(Body.empty() ? Latch : Body.front());
+  for (unsigned I = 0; I < Body.size(); ++I) {
+    B.SetInsertPoint(Body[I]);
+    Value *V = B.CreateLoad(I32, Acc);
+    V = B.CreateMul(V, ConstantInt::get(I32, RNG() % 97 + 3));
+    V = B.CreateXor(V, IVs.empty() ? X : IVs.back());
+    V = B.CreateAdd(V, ConstantInt::get(I32, RNG() % 1000));
+    B.CreateStore(V, Acc);
+    BasicBlock *Next = I + 1 < Body.size() ? Body[I + 1] : Latch;
+    BasicBlock *Skip = I + 2 < Body.size() ? Body[I + 2] : Latch;
+    if (Next == Skip) {
+      B.CreateBr(Next);
+      continue;
+    }
+    Value *Bit = B.CreateAnd(V, ConstantInt::get(I32, 1u << (RNG() % 8)));
+    B.CreateCondBr(B.CreateICmpEQ(Bit, ConstantInt::get(I32, 0)), Next, Skip);
+  }
+
+  // Latches, innermost first, each closing its loop and falling out to the
+  // enclosing one.
+  B.SetInsertPoint(Latch);
+  for (unsigned D = LoopDepth; D-- > 0;) {
+    Value *Next = B.CreateAdd(IVs[D], ConstantInt::get(I32, 1));
+    IVs[D]->addIncoming(Next, B.GetInsertBlock());
+    BasicBlock *Exit = BasicBlock::Create(C, formatv("exit{0}", D), F);
+    B.CreateCondBr(B.CreateICmpULT(Next, ConstantInt::get(I32, 4)), Headers[D],
+                   Exit);
+    B.SetInsertPoint(Exit);
+  }
+  B.CreateRet(B.CreateLoad(I32, Acc));
+}
+
+static std::unique_ptr<Module> buildModule(LLVMContext &C) {
+  auto M = std::make_unique<Module>("obf-synth", C);
+  std::mt19937 RNG(Seed);
+  std::vector<GlobalVariable *> Strings;
+  for (unsigned I = 0; I < NumStrings; ++I) {
+    std::string Text = formatv("synthetic string {0} / {1}", I, RNG()).str();
+    if (Text.size() < StringLength)
+      Text.resize(StringLength, 'a' + I % 26);
+    Constant *Init = ConstantDataArray::getString(C, Text);
+    auto *GV = new GlobalVariable(*M, Init->getType(), /*isConstant=*/true,
+                                  GlobalValue::PrivateLinkage, Init,
+                                  formatv("str.s{0}", I));
+    GV->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+    Strings.push_back(GV);
+  }
+  FunctionCallee Puts = M->getOrInsertFunction(
+      "puts", FunctionType::get(Type::getInt32Ty(C),
+                                {PointerType::getUnqual(C)}, false));
+  for (unsigned I = 0; I < NumFunctions; ++I)
+    buildFunction(*M, I, Strings, Puts, RNG);
+  return M;
+}
+
+static int measure(LLVMContext &C) {
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(MeasureFile, Err, C);
+  if (!M) {
+    Err.print("obf-synth", errs());
+    return 1;
+  }
+  uint64_t Functions = 0, Blocks = 0, Insts = 0;
+  for (const Function &F : *M) {
+    if (F.isDeclaration())
+      continue;
+    ++Functions;
+    Blocks += F.size();
+    Insts += F.getInstructionCount();
+  }
+  outs() << formatv("{{\"functions\": {0}, \"blocks\": {1}, "
+                    "\"instructions\": {2}, \"globals\": {3}}\n",
+                    Functions, Blocks, Insts, M->global_size());
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "synthetic module generator\n");
+  LLVMContext C;
+  if (!MeasureFile.empty())
+    return measure(C);
+
+  std::unique_ptr<Module> M = buildModule(C);
+  if (verifyModule(*M, &errs())) {
+    WithColor::error(errs(), "obf-synth") << "generated an invalid module\n";
+    return 1;
+  }
+  std::error_code EC;
+  ToolOutputFile Out(OutputFilename, EC, sys::fs::OF_None);
+  if (EC) {
+    WithColor::error(errs(), "obf-synth") << EC.message() << "\n";
+    return 1;
+  }
+  WriteBitcodeToFile(*M, Out.os());
+  Out.keep();
+  return 0;
+}
@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+"""
+Repeated-cycle string check.
+
+Generates a synthetic module with obf-synth and runs several obf<...> cycles
+over it, then obf-strip-key. Each cycle after the first replaces the string
+blob and its constructor in place, so the result must still define every
+function the input did and hold exactly one __obf_init constructor; exits
+non-zero otherwise.
+"""
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+
+DEFINE = re.compile(r'^define [^@]*@("[^"]+"|[\w.$-]+)\(', re.M)
+CTORS = re.compile(r'^@llvm\.global_ctors = .*$', re.M)
+INIT = re.compile(r'@(__obf_init[\w.]*)')
+
+def defined_functions(ir):
+    return set(DEFINE.findall(ir))
+
+def string_ctors(ir):
+    ctors = CTORS.search(ir)
+    return INIT.findall(ctors.group(0)) if ctors else []
+
+def disassemble(opt, plugin, passes, in_bc):
+    return subprocess.check_output([opt, "-load-pass-plugin", plugin,
+                                    "-passes=%s" % passes, "-S", in_bc, "-o", "-"],
+                                   universal_newlines=True)
+
+def main():
+    parser = argparse.ArgumentParser(description="Repeated-cycle string check")
+    parser.add_argument("--synth", required=True, help="Path to obf-synth")
+    parser.add_argument("--plugin", required=True, help="Path to obfpass.so")
+    parser.add_argument("--opt", default="opt", help="Path to opt")
+    parser.add_argument("--out", default="cycles", help="Directory for modules and results")
+    parser.add_argument("--functions", type=int, default=50)
+    parser.add_argument("--strings", type=int, default=20)
+    parser.add_argument("--cycles", type=int, default=2)
+    parser.add_argument("--params", default="bogus=0;nops=0;strings=1",
+                        help="obf<...> parameters")
+    args = parser.parse_args()
+
+    os.makedirs(args.out, exist_ok=True)
+    in_bc = os.path.join(args.out, "cycles.bc")
+    subprocess.check_call([args.synth, "-functions=%d" % args.functions,
+                           "-strings=%d" % args.strings, "-o", in_bc])
+    before = defined_functions(disassemble(args.opt, args.plugin, "verify", in_bc))
+    out = disassemble(args.opt, args.plugin, "repeat<%d>(obf<%s>),obf-strip-key"
+                      % (args.cycles, args.params), in_bc)
+    with open(os.path.join(args.out, "cycles.ll"), "w") as f:
+        f.write(out)
+
+    missing = sorted(before - defined_functions(out))
+    ctors = string_ctors(out)
+    result = {"parameters": vars(args), "missing": missing, "ctors": ctors}
+    print("%d functions, %d missing, %d string constructors"
+          % (len(before), len(missing), len(ctors)))
+    with open(os.path.join(args.out, "cycles.json"), "w") as f:
+        json.dump(result, f, indent=2)
+    if missing:
+        print("no longer defined: %s" % ", ".join(missing))
+        sys.exit(1)
+    if len(ctors) != 1:
+        print("expected one string constructor, found %s" % (ctors or "none"))
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
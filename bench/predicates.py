@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+"""
+Opaque-predicate survival check.
+
+Generates a synthetic module with obf-synth, inserts bogus blocks and runs
+instcombine over the result with opt. A predicate the optimizer can prove
+leaves its !obf.pred branch on a constant condition; this counts those per
+tier and exits non-zero if any tier lost a branch.
+"""
+import argparse
+import collections
+import json
+import os
+import re
+import subprocess
+import sys
+
+BRANCH = re.compile(r'^\s*br i1 (\S+), .*!obf\.pred (![0-9]+)', re.M)
+TIER = re.compile(r'^(![0-9]+) = !\{!"(\w+)", i32 [0-9]+\}', re.M)
+
+def count_branches(ir):
+    tiers = dict(TIER.findall(ir))
+    kept = collections.Counter()
+    folded = collections.Counter()
+    for cond, md in BRANCH.findall(ir):
+        tier = tiers.get(md, "?")
+        if cond in ("true", "false"):
+            folded[tier] += 1
+        else:
+            kept[tier] += 1
+    return kept, folded
+
+def main():
+    parser = argparse.ArgumentParser(description="Opaque-predicate survival check")
+    parser.add_argument("--synth", required=True, help="Path to obf-synth")
+    parser.add_argument("--plugin", required=True, help="Path to obfpass.so")
+    parser.add_argument("--opt", default="opt", help="Path to opt")
+    parser.add_argument("--out", default="predicates", help="Directory for modules and results")
+    parser.add_argument("--functions", type=int, default=200)
+    parser.add_argument("--params", default="bogus=4;bogus-loops;nops=0;strings=0",
+                        help="obf<...> parameters")
+    parser.add_argument("--passes", default="instcombine",
+                        help="Passes run after obf<...>")
+    args = parser.parse_args()
+
+    os.makedirs(args.out, exist_ok=True)
+    in_bc = os.path.join(args.out, "predicates.bc")
+    out_ll = os.path.join(args.out, "predicates.ll")
+    subprocess.check_call([args.synth, "-functions=%d" % args.functions, "-blocks=8",
+                           "-loop-depth=2", "-strings=0", "-o", in_bc])
+    subprocess.check_call([args.opt, "-load-pass-plugin", args.plugin,
+                           "-passes=obf<%s>,%s" % (args.params, args.passes),
+                           "-S", in_bc, "-o", out_ll])
+    with open(out_ll) as f:
+        kept, folded = count_branches(f.read())
+
+    result = {"parameters": vars(args), "kept": kept, "folded": folded}
+    for tier in sorted(set(kept) | set(folded)):
+        print("%-10s %6d kept %6d folded" % (tier, kept[tier], folded[tier]))
+    with open(os.path.join(args.out, "predicates.json"), "w") as f:
+        json.dump(result, f, indent=2)
+    if not kept:
+        print("no bogus branches found")
+        sys.exit(1)
+    if folded:
+        print("%s folded %d predicates" % (args.passes, sum(folded.values())))
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+"""
+Compile-time scaling benchmark for the obfuscation pass.
+
+Generates synthetic modules of increasing size with obf-synth, runs each
+transform over them with opt, and records wall time, peak RSS and output
+IR size. Between consecutive sizes it reports the scaling exponent
+log(time ratio) / log(instruction ratio); anything well above 1 means a
+transform grows super-linearly with module size.
+"""
+import argparse
+import json
+import math
+import os
+import subprocess
+import sys
+import time
+
+# One opt pipeline per transform, each with everything else switched off
+TRANSFORMS = {
+    "baseline": "no-op-module",
+    "bogus":    "obf<bogus=2;nops=0;strings=0>",
+    "nops":     "obf<bogus=0;nops=16;strings=0>",
+    "strings":  "obf<bogus=0;nops=0;strings=1>",
+    "flatten":  "obf<bogus=0;nops=0;strings=0;flatten>",
+    "all":      "obf<bogus=2;nops=16;strings=1;flatten>",
+}
+DEFAULT_TRANSFORMS = "baseline,bogus,nops,strings,flatten,all"
+
+def run_measured(cmd):
+    # Wall time and peak RSS (KiB) of this one child, not of all children
+    start = time.perf_counter()
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    stderr = proc.stderr.read()
+    _, status, usage = os.wait4(proc.pid, 0)
+    elapsed = time.perf_counter() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if proc.returncode != 0:
+        raise RuntimeError("command failed: %s\n%s" % (" ".join(cmd), stderr.decode(errors="replace")))
+    return elapsed, usage.ru_maxrss
+
+def measure_ir(synth, path):
+    out = subprocess.check_output([synth, "-measure", path])
+    sizes = json.loads(out)
+    sizes["bytes"] = os.path.getsize(path)
+    return sizes
+
+def generate(args, functions, path):
+    cmd = [args.synth, "-functions=%d" % functions, "-blocks=%d" % args.blocks,
+           "-strings=%d" % int(functions * args.strings_per_function),
+           "-loop-depth=%d" % args.loop_depth, "-seed=%d" % args.seed, "-o", path]
+    subprocess.check_call(cmd)
+
+def exponent(a, b):
+    # How fast time grew relative to the input, between two sweep points
+    if a["time"] <= 0 or b["input"]["instructions"] <= a["input"]["instructions"]:
+        return None
+    return math.log(b["time"] / a["time"]) / math.log(b["input"]["instructions"] / a["input"]["instructions"])
+
+def main():
+    parser = argparse.ArgumentParser(description="Obfuscation compile-time scaling benchmark")
+    parser.add_argument("--synth", required=True, help="Path to obf-synth")
+    parser.add_argument("--plugin", required=True, help="Path to obfpass.so")
+    parser.add_argument("--opt", default="opt", help="Path to opt")
+    parser.add_argument("--out", default="scaling", help="Directory for modules and results")
+    parser.add_argument("--sizes", default="250,1000,4000", help="Comma-separated function counts to sweep")
+    parser.add_argument("--blocks", type=int, default=16, help="Blocks per function")
+    parser.add_argument("--strings-per-function", type=float, default=1.0)
+    parser.add_argument("--loop-depth", type=int, default=2)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--transforms", default=DEFAULT_TRANSFORMS,
+                        help="Comma-separated subset of: " + ", ".join(TRANSFORMS))
+    parser.add_argument("--repeat", type=int, default=3, help="Runs per point; the fastest is kept")
+    parser.add_argument("--max-exponent", type=float, default=1.3,
+                        help="Flag transforms whose scaling exponent exceeds this")
+    parser.add_argument("--strict", action="store_true", help="Exit non-zero if any transform is flagged")
+    args = parser.parse_args()
+
+    os.makedirs(args.out, exist_ok=True)
+    sizes = [int(s) for s in args.sizes.split(",") if s]
+    transforms = [t for t in args.transforms.split(",") if t]
+    for t in transforms:
+        if t not in TRANSFORMS:
+            parser.error("unknown transform '%s'" % t)
+
+    results = {t: [] for t in transforms}
+    for functions in sizes:
+        in_bc = os.path.join(args.out, "synth-%d.bc" % functions)
+        generate(args, functions, in_bc)
+        input_size = measure_ir(args.synth, in_bc)
+        for t in transforms:
+            out_bc = os.path.join(args.out, "synth-%d.%s.bc" % (functions, t))
+            cmd = [args.opt, "-load-pass-plugin", args.plugin, "-passes=" + TRANSFORMS[t], in_bc, "-o", out_bc]
+            try:
+                runs = [run_measured(cmd) for _ in range(max(1, args.repeat))]
+            except RuntimeError as e:
+                # keep sweeping; a broken transform shows up in the results
+                print("%-9s %7d fns FAILED" % (t, functions))
+                results[t].append({"functions": functions, "input": input_size, "error": str(e)})
+                continue
+            point = {
+                "functions": functions,
+                "input": input_size,
+                "output": measure_ir(args.synth, out_bc),
+                "time": min(r[0] for r in runs),
+                "peak_rss_kb": max(r[1] for r in runs),
+            }
+            results[t].append(point)
+            print("%-9s %7d fns %9d -> %9d insts %8.3fs %8d KiB" % (
+                t, functions, input_size["instructions"], point["output"]["instructions"],
+                point["time"], point["peak_rss_kb"]))
+
+    flagged = []
+    print("\nscaling exponent (time vs. input instructions, 1.0 = linear)")
+    for t in transforms:
+        points = [p for p in results[t] if "error" not in p]
+        exps = [exponent(a, b) for a, b in zip(points, points[1:])]
+        for p, e in zip(points[1:], exps):
+            p["exponent"] = e
+        shown = ["%.2f" % e if e is not None else "-" for e in exps]
+        worst = max([e for e in exps if e is not None], default=None)
+        mark = ""
+        if worst is not None and worst > args.max_exponent:
+            flagged.append(t)
+            mark = "  <-- super-linear"
+        print("%-9s %s%s" % (t, " ".join(shown), mark))
+
+    with open(os.path.join(args.out, "scaling.json"), "w") as f:
+        json.dump({"parameters": vars(args), "results": results, "flagged": flagged}, f, indent=2)
+    print("\nresults written to", os.path.join(args.out, "scaling.json"))
+    if flagged and args.strict:
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""
+Startup string-decryption throughput benchmark.
+
+Generates a synthetic module holding --megabytes of str.* strings with
+obf-synth, builds it into a shared library once as is and once with the
+strings encrypted, and times dlopen() of both. The difference is the
+startup cost, which is dominated by the first write to each page of the
+blob. The throughput in GB/s comes from calling the constructor, exported
+as __obf_init, again once the library is loaded: its pages are resident
+by then, so only the decryption loop is timed.
+"""
+import argparse
+import _ctypes
+import ctypes
+import json
+import os
+import re
+import shutil
+import subprocess
+import time
+
+def build_library(args, in_bc, passes, name, export_init=False):
+    ll = os.path.join(args.out, name + ".ll")
+    obj = os.path.join(args.out, name + ".o")
+    lib = os.path.join(args.out, name + ".so")
+    subprocess.check_call([args.opt, "-load-pass-plugin", args.plugin, "-passes=" + passes, "-S", in_bc, "-o", ll])
+    if export_init:
+        with open(ll) as f:
+            ir = f.read()
+        ir, found = re.subn(r"^define internal void @__obf_init\(", "define void @__obf_init(", ir, flags=re.M)
+        if not found:
+            raise SystemExit("no __obf_init in " + ll)
+        with open(ll, "w") as f:
+            f.write(ir)
+    subprocess.check_call([args.llc, "-O2", "-relocation-model=pic", "-filetype=obj"] + args.llc_args + [ll, "-o", obj])
+    subprocess.check_call([args.cc, "-shared", obj, "-o", lib])
+    return lib
+
+def time_load(lib, repeat):
+    # A fresh copy per load, so dlopen cannot hand back the loaded one
+    best = None
+    for i in range(repeat):
+        copy = "%s.%d" % (lib, i)
+        shutil.copyfile(lib, copy)
+        start = time.perf_counter()
+        handle = ctypes.CDLL(copy, mode=os.RTLD_NOW)
+        elapsed = time.perf_counter() - start
+        _ctypes.dlclose(handle._handle)
+        os.remove(copy)
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+def time_decrypt(lib, repeat):
+    # Loading runs the constructor once, which faults the blob's pages in;
+    # every further call runs the same loop over resident pages
+    handle = ctypes.CDLL(lib, mode=os.RTLD_NOW)
+    init = handle["__obf_init"]
+    init.restype = None
+    best = None
+    for _ in range(repeat):
+        start = time.perf_counter()
+        init()
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    _ctypes.dlclose(handle._handle)
+    return best
+
+def main():
+    parser = argparse.ArgumentParser(description="Startup string-decryption throughput benchmark")
+    parser.add_argument("--synth", required=True, help="Path to obf-synth")
+    parser.add_argument("--plugin", required=True, help="Path to obfpass.so")
+    parser.add_argument("--opt", default="opt", help="Path to opt")
+    parser.add_argument("--llc", default="llc", help="Path to llc")
+    parser.add_argument("--cc", default="cc", help="Compiler used to link the shared libraries")
+    parser.add_argument("--llc-args", default="", help="Extra llc arguments, e.g. -mattr=+avx2")
+    parser.add_argument("--out", default="strings", help="Directory for modules and results")
+    parser.add_argument("--megabytes", type=int, default=64, help="Total size of the strings")
+    parser.add_argument("--string-length", type=int, default=4096)
+    parser.add_argument("--params", default="bogus=0;nops=0;strings=1", help="obf<...> parameters")
+    parser.add_argument("--repeat", type=int, default=5, help="Loads and decrypt runs per library; the fastest is kept")
+    args = parser.parse_args()
+    if "cow-strings" in args.params:
+        # the constructor leaves the blob read-only, so it cannot run twice
+        parser.error("cow-strings cannot be measured")
+    args.llc_args = args.llc_args.split()
+
+    os.makedirs(args.out, exist_ok=True)
+    strings = max(1, args.megabytes * (1 << 20) // args.string_length)
+    in_bc = os.path.join(args.out, "strings.bc")
+    subprocess.check_call([args.synth, "-functions=1", "-blocks=1", "-loop-depth=0",
+                           "-strings=%d" % strings, "-string-length=%d" % args.string_length,
+                           "-o", in_bc])
+    plain = time_load(build_library(args, in_bc, "no-op-module", "plain"), args.repeat)
+    lib = build_library(args, in_bc, "obf<%s>" % args.params, "encrypted", export_init=True)
+    encrypted = time_load(lib, args.repeat)
+    decrypt = max(time_decrypt(lib, args.repeat), 1e-9)
+
+    nbytes = strings * (args.string_length + 1)
+    result = {"parameters": vars(args), "strings": strings, "bytes": nbytes,
+              "load_plain_s": plain, "load_encrypted_s": encrypted,
+              "startup_s": encrypted - plain,
+              "decrypt_s": decrypt, "gb_per_s": nbytes / decrypt / 1e9}
+    print("%d strings, %.1f MiB: load %.3f ms plain, %.3f ms encrypted; decrypt %.3f ms -> %.2f GB/s" % (
+        strings, nbytes / float(1 << 20), plain * 1e3, encrypted * 1e3, decrypt * 1e3, result["gb_per_s"]))
+    with open(os.path.join(args.out, "strings.json"), "w") as f:
+        json.dump(result, f, indent=2)
+    print("results written to", os.path.join(args.out, "strings.json"))
+
+if __name__ == "__main__":
+    main()
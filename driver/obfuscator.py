@@ -1,10 +1,12 @@
 #!/usr/bin/env python3
 import os
+import re
 import subprocess
 import json
 import sys
 import shutil
 import argparse
+import glob
 import datetime
 from tabulate import tabulate
 
@@ -26,69 +28,121 @@ def run(cmd, cwd=None, capture=False, capture_stderr=False):
     else:
         subprocess.check_call(cmd, cwd=cwd)
 
-def compile_to_bc(src, out_bc, target=None):
-    cmd = [CLANG, "-O1", "-emit-llvm", "-c", src, "-o", out_bc]
+def profile_flags(profile):
+    # clang reads the profile into the IR it was collected on, before -O1
+    # changes it; a sampled profile is matched through line tables
+    if not profile:
+        return []
+    with open(profile, "rb") as f:
+        indexed = f.read(8) == b"\xfflprofi\x81"
+    if indexed:
+        return ["-fprofile-instr-use=" + profile]
+    return ["-fprofile-sample-use=" + profile, "-gline-tables-only"]
+
+def compile_to_bc(src, out_bc, target=None, profile=None):
+    cmd = [CLANG, "-O1", "-emit-llvm", "-c", src, "-o", out_bc] + profile_flags(profile)
     if target:
         cmd.insert(1, "--target="+target)
     run(cmd)
 
-def _extract_headers_from_bc(bc_path):
-    try:
-        out = run(["llvm-dis", bc_path, "-o", "-"], capture=True)
-    except Exception:
-        return None, None
-    triple = None
-    datalayout = None
-    for line in out.splitlines():
-        if line.startswith("target datalayout"):
-            datalayout = line
-        elif line.startswith("target triple"):
-            triple = line
-        if triple and datalayout:
-            break
-    return datalayout, triple
-
-def apply_pass(in_bc, out_bc, pass_plugin, options, cycles=1):
-    # We'll set module global variables as options for the pass to read
-    temp_bc = in_bc
-    # build mod options small bitcode patch: easier approach, create small LLVM IR file with globals then link
-    # create options.ll with same target layout/triple as input
-    opt_ll = "obf_options.ll"
-    dl, tt = _extract_headers_from_bc(in_bc)
-    with open(opt_ll, "w") as f:
-        f.write("; Module to provide obfuscation options\n")
-        if dl:
-            f.write(dl + "\n")
-        if tt:
-            f.write(tt + "\n")
-        # mark globals internal to avoid multiply-defined on relinking
-        f.write("@obf_bogus_blocks = internal global i32 %d\n" % options['bogus_blocks'])
-        f.write("@obf_string_level = internal global i32 %d\n" % options['string_level'])
-        f.write("@obf_insert_nops = internal global i32 %d\n" % options['insert_nops'])
-        f.write("@obf_flatten = internal global i1 %d\n" % (1 if options.get('flatten') else 0))
-    # compile options.ll to bc
-    run(["llvm-as", opt_ll, "-o", "obf_options.bc"])
-    # link the two bcs once
-    run(["llvm-link", temp_bc, "obf_options.bc", "-o", "linked.bc"])
-    stderr_accum = ""
-    # Try single-invocation repeat; on failure, fall back to multiple invocations
+def pass_params(options):
+    # obf<...> takes the options as pipeline parameters, so the input module
+    # goes straight into opt without an options module being linked in
+    params = ["bogus=%d" % options['bogus_blocks'],
+              "nops=%d" % options['insert_nops'],
+              "strings=%d" % options['string_level']]
+    if options.get('flatten'):
+        params.append("flatten")
+    if options.get('bogus_loops'):
+        params.append("bogus-loops")
+    if options.get('cold_bogus'):
+        params.append("cold-bogus")
+    if options.get('lazy_strings'):
+        params.append("lazy-strings")
+    if options.get('stack_strings'):
+        params.append("stack-strings")
+    if options.get('cow_strings'):
+        params.append("cow-strings")
+    if options.get('partitions', 0) > 1:
+        params.append("parts=%d" % options['partitions'])
+        params.append("threads=%d" % options.get('threads', 0))
+    if options.get('max_growth'):
+        params.append("max-growth=%d" % options['max_growth'])
+    if options.get('selected_only'):
+        params.append("selected-only")
+    if options.get('policy'):
+        params.append("policy=" + options['policy'])
+    if options.get('seed'):
+        params.append("seed=%d" % options['seed'])
+    if options.get('hot_ratio'):
+        params.append("hot=%d" % options['hot_ratio'])
+    if options.get('budget'):
+        params.append("budget=%d" % options['budget'])
+    if options.get('cache_dir'):
+        params.append("cache=" + options['cache_dir'])
+    return ";".join(params)
+
+def pass_pipeline(options, cycles=1):
+    spec = "obf<%s>" % pass_params(options)
     if cycles and cycles > 1:
-        try:
-            passes_spec = f"repeat<{cycles}>(obf-legacy)"
-            cmd = [LLVM_OPT, "-load-pass-plugin", pass_plugin, f"-passes={passes_spec}", "linked.bc", "-o", out_bc]
-            _, stderr_text = run(cmd, capture_stderr=True)
-            return stderr_text
-        except subprocess.CalledProcessError:
-            pass
-    # Fallback: run opt multiple times without relinking options
-    src_bc = "linked.bc"
-    tmp_out = out_bc
-    for i in range(max(1, cycles)):
-        cmd = [LLVM_OPT, "-load-pass-plugin", pass_plugin, "-passes=obf-legacy", src_bc, "-o", tmp_out]
-        _, stderr_text = run(cmd, capture_stderr=True)
-        stderr_accum += (stderr_text or "")
-        src_bc = tmp_out
-    return stderr_accum
+        spec = "repeat<%d>(%s)" % (cycles, spec)
+    # the blob's key is only needed between cycles
+    return spec + ",obf-strip-key"
+
+def apply_pass(in_bc, out_bc, pass_plugin, options, cycles=1, remarks=None, time_trace=None, time_passes=False):
+    cmd = [LLVM_OPT, "-load-pass-plugin", pass_plugin, "-passes=" + pass_pipeline(options, cycles), in_bc, "-o", out_bc,
+           "-stats", "-stats-json"]
+    if remarks:
+        # per-function, per-transform counters as optimization remarks
+        cmd += ["-pass-remarks-output=" + remarks, "-pass-remarks-filter=obfuscation"]
+    if time_trace:
+        # Chrome trace with one event per function and per transform
+        cmd += ["-time-trace", "-time-trace-file=" + time_trace]
+    if time_passes:
+        cmd.append("-time-passes")
+    _, stderr_text = run(cmd, capture_stderr=True)
+    return stderr_text
+
+def apply_lazy(in_bc, out_dir, lazy_tool, options, cycles=1, remarks=None):
+    # bounded-memory mode: obf-lazy writes one bitcode file per chunk of
+    # functions plus globals.bc, each compiled separately
+    if os.path.isdir(out_dir):
+        shutil.rmtree(out_dir)
+    cmd = [lazy_tool, "-obf=" + pass_params(options), "-cycles=%d" % cycles, in_bc, "-o", out_dir]
+    if remarks:
+        cmd.append("-remarks=" + remarks)
+    run(cmd)
+    return sorted(os.path.join(out_dir, f) for f in os.listdir(out_dir) if f.endswith(".bc"))
+
+def compile_in_process(src, out_exe, cc_tool, options, cycles=1, target=None, remarks=None, stage_report=None):
+    # obf-cc parses, obfuscates and generates code in one process; only the
+    # final link runs separately
+    cmd = [cc_tool, "-obf=" + pass_params(options), "-cycles=%d" % cycles, "-O1", src, "-o", out_exe]
+    for flag in profile_flags(options.get('pgo_profile')):
+        cmd += ["-Xcc", flag]
+    if target:
+        cmd += ["-target", target, "-Xlink", "--target=" + target, "-Xlink", "-static", "-Xlink", "-lws2_32"]
+    if remarks:
+        cmd.append("-remarks=" + remarks)
+    if stage_report:
+        cmd.append("-stage-report=" + stage_report)
+    run(cmd)
+
+def compile_lto(src, obj, pass_plugin, options, cycles=1, mode="thin"):
+    # the pre-link pipeline only records the options in the bitcode object;
+    # the linker's LTO backends obfuscate with them (-fplugin makes -mllvm
+    # know the plugin's options)
+    run([CLANG, "-O2", "-flto=" + mode, "-fplugin=" + pass_plugin, "-fpass-plugin=" + pass_plugin,
+         "-mllvm", "-obf-params=" + pass_params(options), "-mllvm", "-obf-cycles=%d" % cycles,
+         "-c", src, "-o", obj] + profile_flags(options.get('pgo_profile')))
+
+def lto_link_args(pass_plugin, mode="thin", remarks=None, cache_dir=None):
+    args = ["-flto=" + mode, "-fuse-ld=lld", "-Wl,--load-pass-plugin=" + pass_plugin]
+    if remarks:
+        args += ["-Wl,--opt-remarks-filename=" + remarks, "-Wl,--opt-remarks-passes=obfuscation"]
+    if cache_dir and mode == "thin":
+        args.append("-Wl,--thinlto-cache-dir=" + cache_dir)
+    return args
 
 def bc_to_obj(bc, obj, mcpu=None):
     cmd = [LLC, "-filetype=obj", bc, "-o", obj]
@@ -100,19 +154,98 @@ def link_objects(objs, out_exe, linker_args=[]):
     cmd = [CLANGXX] + objs + ["-o", out_exe] + linker_args
     run(cmd)
 
-def gather_stats(stdout_text):
-    # parse stats from opt stderr if available - our pass writes to stderr
-    stats = {}
-    for line in stdout_text.splitlines():
-        if line.startswith("ObfuscationPass:"):
-            parts = line.split()
-            for part in parts[1:]:
-                if '=' in part:
-                    k,v = part.split('=',1)
-                    stats[k] = int(v)
-    return stats
-
-def generate_report(report_path, params, out_file, stats, final_size, cycles, methods_applied, tool_versions):
+def parse_remarks(path):
+    # Minimal reader for the YAML remarks the pass emits: one document per
+    # remark, top-level keys plus "  - Key: 'value'" argument lines
+    remarks = []
+    cur = None
+    with open(path) as f:
+        for line in f:
+            line = line.rstrip("\n")
+            if line.startswith("--- !"):
+                cur = {"Kind": line[5:], "Args": {}}
+                remarks.append(cur)
+            elif cur is None or line.startswith("    "):
+                continue
+            elif line.startswith("  - "):
+                k, _, v = line[4:].partition(":")
+                if k != "String":
+                    cur["Args"][k] = v.strip().strip("'")
+            elif ":" in line and not line.startswith("Args:"):
+                k, _, v = line.partition(":")
+                cur[k] = v.strip().strip("'")
+    return remarks
+
+def gather_stats(remarks):
+    # Sum the per-cycle remarks; instruction/block deltas span all cycles
+    totals = {"bogus_blocks": 0, "strings": 0, "string_bytes": 0,
+              "lazy_strings": 0, "stack_strings": 0, "dirty_pages": 0,
+              "string_layers": 0, "nops": 0,
+              "fake_loops": 0, "insts_added": 0, "blocks_added": 0,
+              "cached_functions": 0}
+    functions = {}
+    for r in remarks:
+        if r.get("Pass") != "obfuscation":
+            continue
+        a = {k: int(v) for k, v in r["Args"].items() if v.isdigit()}
+        if r.get("Name") == "StringsEncrypted":
+            totals["strings"] += a.get("Strings", 0)
+            totals["string_bytes"] += a.get("Bytes", 0)
+            totals["lazy_strings"] += a.get("LazyStrings", 0)
+            totals["stack_strings"] += a.get("StackStrings", 0)
+            totals["dirty_pages"] += a.get("DirtyPages", 0)
+            # every cycle adds a layer; the last remark has them all
+            totals["string_layers"] = max(totals["string_layers"], a.get("Layers", 0))
+        elif r.get("Name") == "FunctionObfuscated":
+            fn = functions.setdefault(r.get("Function"), {
+                "bogus_blocks": 0, "nops": 0, "fake_loops": 0,
+                "insts_before": a.get("InstsBefore", 0), "blocks_before": a.get("BlocksBefore", 0)})
+            fn["bogus_blocks"] += a.get("BogusBlocks", 0)
+            fn["nops"] += a.get("Nops", 0)
+            fn["fake_loops"] += a.get("FakeLoops", 0)
+            fn["insts_after"] = a.get("InstsAfter", 0)
+            fn["blocks_after"] = a.get("BlocksAfter", 0)
+            fn["hot_blocks"] = a.get("HotBlocks", 0)
+            fn["budget_used"] = a.get("BudgetUsed", 0)
+            fn["predicates"] = {
+                "alu": a.get("AluPredicates", 0),
+                "algebraic": a.get("AlgebraicPredicates", 0),
+                "state": a.get("StatePredicates", 0)}
+            fn["predicate_latency"] = a.get("PredicateLatency", 0)
+            if r["Args"].get("FromCache") == "true":
+                totals["cached_functions"] += 1
+    for fn in functions.values():
+        for k in ("bogus_blocks", "nops", "fake_loops"):
+            totals[k] += fn[k]
+        totals["insts_added"] += fn["insts_after"] - fn["insts_before"]
+        totals["blocks_added"] += fn["blocks_after"] - fn["blocks_before"]
+    return totals, functions
+
+def parse_stats_json(stderr_text):
+    # -stats-json prints one JSON object at exit; LLVM builds without
+    # statistics print nothing usable, so this is best effort. The object
+    # starts a line, possibly the first one, and other output may follow
+    decoder = json.JSONDecoder()
+    for m in reversed(list(re.finditer(r"(?m)^\{", stderr_text))):
+        try:
+            stats, _ = decoder.raw_decode(stderr_text, m.start())
+        except ValueError:
+            continue
+        if isinstance(stats, dict):
+            return {k: v for k, v in stats.items() if k.startswith("obfuscation.")} or None
+    return None
+
+def save_time_report(stderr_text, path):
+    # -time-passes tables (including "Obfuscation transforms") go to stderr
+    start = stderr_text.find("===---")
+    if start < 0:
+        return None
+    with open(path, "w") as f:
+        f.write(stderr_text[stderr_text.rfind("\n", 0, start) + 1:])
+    return path
+
+def generate_report(report_path, params, out_file, stats, final_size, cycles, methods_applied, tool_versions, profiling=None,
+                    functions=None, statistics=None):
     report = {
       "timestamp": datetime.datetime.utcnow().isoformat() + "Z",
       "input_parameters": params,
@@ -125,6 +258,12 @@ def generate_report(report_path, params, out_file, stats, final_size, cycles, me
       "methods_applied": methods_applied,
       "tools": tool_versions,
     }
+    if functions:
+        report["functions"] = functions
+    if statistics:
+        report["statistics"] = statistics
+    if profiling:
+        report["profiling"] = profiling
     with open(report_path, "w") as f:
         json.dump(report, f, indent=2)
     # pretty
@@ -143,6 +282,29 @@ def main():
     parser.add_argument("--cycles", type=int, default=1)
     parser.add_argument("--profile", choices=["light","medium","aggressive"], default=None)
     parser.add_argument("--flatten", action="store_true", help="Enable basic control-flow flattening")
+    parser.add_argument("--bogus-loops", action="store_true", help="Let bogus blocks go into loop bodies as well")
+    parser.add_argument("--cold-bogus", action="store_true", help="Outline bogus block bodies into cold functions in .text.unlikely")
+    parser.add_argument("--lazy-strings", action="store_true", help="Decrypt each string on first use instead of at startup")
+    parser.add_argument("--stack-strings", action="store_true", help="Decrypt strings only cold code uses onto the stack at each use")
+    parser.add_argument("--cow-strings", action="store_true", help="Decrypt strings into read-only pages of their own that forked processes share")
+    parser.add_argument("--partitions", type=int, default=0, help="Obfuscate the module as N partitions in parallel (output depends only on N)")
+    parser.add_argument("--threads", type=int, default=0, help="Worker threads for --partitions (0 = all cores)")
+    parser.add_argument("--max-growth", type=int, default=0, help="Stop adding code to a function once it has grown by this many percent over all cycles (0 = no cap)")
+    parser.add_argument("--budget", type=int, default=0, help="Add at most this many percent of each function's estimated run time (0 = no budget)")
+    parser.add_argument("--policy", default=None, help="YAML/JSON policy file selecting functions and their levels")
+    parser.add_argument("--selected-only", action="store_true", help="Only obfuscate functions selected by annotate(\"obf...\") or the policy")
+    parser.add_argument("--seed", type=int, default=0, help="Seed for every random choice; the same seed and input give the same output")
+    parser.add_argument("--pgo-profile", default=None, help="Instrumented (.profdata) or sampled (AutoFDO) profile; hot blocks get no bogus code or NOPs")
+    parser.add_argument("--hot", type=int, default=0, help="Without a profile, treat blocks run at least this many times per call as hot (0 = off)")
+    parser.add_argument("--cache-dir", default=None, help="Reuse obfuscated functions from this directory when their IR and options are unchanged")
+    parser.add_argument("--lazy", action="store_true", help="Obfuscate function by function with obf-lazy to bound memory use")
+    parser.add_argument("--lazy-tool", default=None, help="Path to obf-lazy (default: next to --pass)")
+    parser.add_argument("--in-process", action="store_true", help="Compile, obfuscate and generate code inside obf-cc instead of clang/opt/llc")
+    parser.add_argument("--cc-tool", default=None, help="Path to obf-cc (default: next to --pass)")
+    parser.add_argument("--lto", choices=["thin", "full"], default=None, help="Obfuscate at link time with ThinLTO or full LTO (needs lld)")
+    parser.add_argument("--lto-cache-dir", default=None, help="Incremental ThinLTO cache directory for --lto thin")
+    parser.add_argument("--time-trace", action="store_true", help="Save a Chrome trace of the pass next to report.json")
+    parser.add_argument("--time-passes", action="store_true", help="Save the per-transform -time-passes breakdown next to report.json")
     args = parser.parse_args()
 
     base = os.path.abspath(os.path.dirname(__file__))
@@ -169,24 +331,91 @@ def main():
       "string_level": slevel,
       "insert_nops": nops,
       "target": args.target,
-      "flatten": bool(args.flatten)
+      "flatten": bool(args.flatten),
+      "bogus_loops": bool(args.bogus_loops),
+      "cold_bogus": bool(args.cold_bogus),
+      "lazy_strings": bool(args.lazy_strings),
+      "stack_strings": bool(args.stack_strings),
+      "cow_strings": bool(args.cow_strings),
+      "partitions": args.partitions,
+      "threads": args.threads,
+      "max_growth": args.max_growth,
+      "budget": args.budget,
+      "seed": args.seed,
+      "policy": os.path.abspath(args.policy) if args.policy else None,
+      "selected_only": bool(args.selected_only),
+      "pgo_profile": os.path.abspath(args.pgo_profile) if args.pgo_profile else None,
+      "hot_ratio": args.hot,
+      "cache_dir": os.path.abspath(args.cache_dir) if args.cache_dir else None
     }
 
-    compile_to_bc(src, tmp_bc, target=None)
-    cumulative_stats = {"bogus_blocks": 0, "strings": 0, "nops": 0}
-    # apply pass with cycles in a single opt invocation to avoid relinking
-    stderr_text = apply_pass(tmp_bc, obf_bc, args.plugin, params, cycles=max(1, args.cycles))
-    stats = gather_stats(stderr_text or "")
-    for k in cumulative_stats:
-        cumulative_stats[k] = cumulative_stats.get(k, 0) + stats.get(k, 0)
-    bc_to_obj(obf_bc, obj)
-
-    # link: choose cross-linker if windows target
-    if args.target == "linux":
-        link_objects([obj], out_exe)
+    # apply pass with cycles in a single opt invocation
+    report_dir = os.path.dirname(os.path.abspath("report.json"))
+    trace_path = os.path.join(report_dir, "report.trace.json") if args.time_trace else None
+    remarks_path = os.path.join(report_dir, "report.remarks.yaml")
+    stages_path = os.path.join(report_dir, "report.stages.json")
+    if args.in_process:
+        cc_tool = args.cc_tool or os.path.join(os.path.dirname(os.path.abspath(args.plugin)), "obf-cc")
+        compile_in_process(src, out_exe, cc_tool, params, cycles=max(1, args.cycles),
+                           target="x86_64-w64-mingw32" if args.target == "windows" else None,
+                           remarks=remarks_path, stage_report=stages_path)
+        stderr_text = ""
+    elif args.lto:
+        for path in [remarks_path] + glob.glob(remarks_path + ".thin.*.yaml"):
+            if os.path.exists(path):
+                os.remove(path)
+        compile_lto(src, obj, args.plugin, params, cycles=max(1, args.cycles), mode=args.lto)
+        stderr_text = ""
+    elif args.lazy:
+        compile_to_bc(src, tmp_bc, target=None, profile=params['pgo_profile'])
+        lazy_tool = args.lazy_tool or os.path.join(os.path.dirname(os.path.abspath(args.plugin)), "obf-lazy")
+        parts = apply_lazy(tmp_bc, "obf.parts", lazy_tool, params, cycles=max(1, args.cycles),
+                           remarks=remarks_path)
+        stderr_text = ""
+    else:
+        compile_to_bc(src, tmp_bc, target=None, profile=params['pgo_profile'])
+        stderr_text = apply_pass(tmp_bc, obf_bc, args.plugin, params, cycles=max(1, args.cycles),
+                                 remarks=remarks_path, time_trace=trace_path, time_passes=args.time_passes)
+    profiling = {}
+    if args.in_process and os.path.exists(stages_path):
+        with open(stages_path) as f:
+            profiling["stages"] = json.load(f)
+    if trace_path and os.path.exists(trace_path):
+        profiling["time_trace"] = trace_path
+    if args.time_passes:
+        time_report = save_time_report(stderr_text or "", os.path.join(report_dir, "report.time.txt"))
+        if time_report:
+            profiling["time_passes"] = time_report
+    statistics = parse_stats_json(stderr_text or "")
+    if args.in_process:
+        objs = []
+    elif args.lto:
+        objs = [obj]
+    elif args.lazy:
+        objs = []
+        for part in parts:
+            bc_to_obj(part, part[:-3] + ".o")
+            objs.append(part[:-3] + ".o")
+    else:
+        bc_to_obj(obf_bc, obj)
+        objs = [obj]
+
+    # link: choose cross-linker if windows target; obf-cc has linked already
+    lto_args = lto_link_args(args.plugin, args.lto, remarks_path, args.lto_cache_dir) if args.lto else []
+    if not objs:
+        pass
+    elif args.target == "linux":
+        link_objects(objs, out_exe, linker_args=lto_args)
     else:
         # windows target: use mingw-w64 clang++ (assumes installed)
-        link_objects([obj], out_exe, linker_args=["-static", "-lws2_32"])
+        link_objects(objs, out_exe, linker_args=lto_args + ["-static", "-lws2_32"])
+
+    # ThinLTO backends write one remarks file per task next to remarks_path
+    remarks = parse_remarks(remarks_path) if os.path.exists(remarks_path) else []
+    if args.lto == "thin":
+        for path in sorted(glob.glob(remarks_path + ".thin.*.yaml")):
+            remarks += parse_remarks(path)
+    cumulative_stats, functions = gather_stats(remarks)
 
     final_size = os.path.getsize(out_exe) if os.path.exists(out_exe) else 0
     methods = []
@@ -202,7 +431,8 @@ def main():
         "clang": (run([CLANG, "--version"], capture=True).splitlines()[0] if shutil.which(CLANG) else None),
         "opt": (run([LLVM_OPT, "--version"], capture=True).splitlines()[0] if shutil.which(LLVM_OPT) else None),
     }
-    generate_report("report.json", params, out_exe, cumulative_stats, final_size, max(1, args.cycles), methods, tool_versions)
+    generate_report("report.json", params, out_exe, cumulative_stats, final_size, max(1, args.cycles), methods, tool_versions, profiling,
+                    functions, statistics)
 
 if __name__ == "__main__":
     main()
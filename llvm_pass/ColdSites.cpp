@@ -0,0 +1,131 @@
+#include "ObfuscationPass.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/InstrTypes.h"
+#include <algorithm>
+#include <tuple>
+
+using namespace llvm;
+
+namespace {
+// How cold a block is known to be, coldest first; blocks of the same class
+// are ordered by frequency.
+enum SiteClass {
+  LeadsToUnreachable, // every path out of it ends in unreachable/noreturn
+  ColdPath,           // exception handling or a call to a cold function
+  Ordinary,
+};
+
+struct Site {
+  Instruction *Split;
+  SiteClass Class;
+  uint64_t Freq;
+  unsigned Index;
+};
+} // namespace
+
+// Blocks from which every path ends in an unreachable or a noreturn call:
+// error exits, assertion failures, abort().
+static SmallPtrSet<const BasicBlock *, 8> findDoomedBlocks(Function &F) {
+  SmallPtrSet<const BasicBlock *, 8> Doomed;
+  for (BasicBlock &BB : F) {
+    if (isa<UnreachableInst>(BB.getTerminator()))
+      Doomed.insert(&BB);
+    for (Instruction &I : BB)
+      if (auto *CB = dyn_cast<CallBase>(&I))
+        if (CB->doesNotReturn())
+          Doomed.insert(&BB);
+  }
+  // Post order visits successors first, so this settles in a few rounds.
+  for (bool Changed = true; Changed;) {
+    Changed = false;
+    for (BasicBlock *BB : post_order(&F))
+      if (!Doomed.count(BB) && succ_size(BB) &&
+          all_of(successors(BB),
+                 [&](const BasicBlock *S) { return Doomed.count(S); }))
+        Changed |= Doomed.insert(BB).second;
+  }
+  return Doomed;
+}
+
+static bool isColdPath(const BasicBlock &BB) {
+  if (BB.isEHPad())
+    return true;
+  for (const Instruction &I : BB)
+    if (auto *CB = dyn_cast<CallBase>(&I))
+      if (CB->hasFnAttr(Attribute::Cold))
+        return true;
+  return false;
+}
+
+// Where a block is split: in front of its first original instruction, past
+// PHIs, EH pads, entry allocas and anything earlier cycles inserted.
+static Instruction *findSplitPoint(BasicBlock &BB) {
+  for (Instruction &I : BB) {
+    if (isa<PHINode>(I) || I.isEHPad() || obf::isObfuscation(I) ||
+        (isa<AllocaInst>(I) && BB.isEntryBlock()))
+      continue;
+    return &I;
+  }
+  return nullptr;
+}
+
+SmallVector<Instruction *, 8>
+obf::findColdSites(Function &F, const HotBlockSet &Hot, const LoopInfo *LI,
+                   const BlockFrequencyInfo &BFI, bool AllowLoops) {
+  SmallPtrSet<const BasicBlock *, 8> Doomed = findDoomedBlocks(F);
+  SmallVector<Site, 16> Sites;
+  unsigned Index = 0;
+  for (BasicBlock &BB : F) {
+    ++Index;
+    if (Hot.count(&BB) || (!AllowLoops && LI && LI->getLoopFor(&BB)))
+      continue;
+    Instruction *Split = findSplitPoint(BB);
+    if (!Split)
+      continue;
+    SiteClass Class = Doomed.count(&BB) ? LeadsToUnreachable
+                      : isColdPath(BB)  ? ColdPath
+                                        : Ordinary;
+    Sites.push_back(
+        {Split, Class, BFI.getBlockFreq(&BB).getFrequency(), Index});
+  }
+  // Function order breaks ties, so the choice is deterministic.
+  llvm::sort(Sites, [](const Site &A, const Site &B) {
+    return std::tie(A.Class, A.Freq, A.Index) <
+           std::tie(B.Class, B.Freq, B.Index);
+  });
+  SmallVector<Instruction *, 8> Result;
+  for (const Site &S : Sites)
+    Result.push_back(S.Split);
+  return Result;
+}
+
+SmallPtrSet<const BasicBlock *, 8>
+obf::findColdBlocks(Function &F, ProfileSummaryInfo *PSI) {
+  SmallPtrSet<const BasicBlock *, 8> Cold;
+  if (F.hasFnAttribute(Attribute::Cold)) {
+    for (BasicBlock &BB : F)
+      Cold.insert(&BB);
+    return Cold;
+  }
+  Cold = findDoomedBlocks(F);
+  for (BasicBlock &BB : F)
+    if (isColdPath(BB))
+      Cold.insert(&BB);
+  if (!PSI || !PSI->hasProfileSummary())
+    return Cold;
+  // Module passes have no cached BFI to ask.
+  DominatorTree DT(F);
+  LoopInfo LI(DT);
+  BranchProbabilityInfo BPI(F, LI);
+  BlockFrequencyInfo BFI(F, BPI, LI);
+  for (BasicBlock &BB : F)
+    if (PSI->isColdBlock(&BB, &BFI))
+      Cold.insert(&BB);
+  return Cold;
+}
@@ -0,0 +1,131 @@
+#include "ObfuscationPass.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+
+using namespace llvm;
+
+// Latency approximates the cycles one more instruction adds to a call.
+static constexpr TargetTransformInfo::TargetCostKind CostKind =
+    TargetTransformInfo::TCK_Latency;
+
+static uint64_t toUnits(InstructionCost C) {
+  return C.isValid() ? (uint64_t)std::max<int64_t>(*C.getValue(), 0) : 0;
+}
+
+uint64_t obf::getLatency(const TargetTransformInfo &TTI, const Instruction &I) {
+  return toUnits(TTI.getInstructionCost(&I, CostKind));
+}
+
+uint64_t obf::getBranchLatency(const TargetTransformInfo &TTI) {
+  return toUnits(TTI.getCFInstrCost(Instruction::Br, CostKind));
+}
+
+std::string obf::describeLatencies(const TargetTransformInfo &TTI,
+                                   const Function &F) {
+  std::string S;
+  raw_string_ostream OS(S);
+  for (const BasicBlock &BB : F)
+    for (const Instruction &I : BB)
+      OS << getLatency(TTI, I) << ',';
+  LLVMContext &C = F.getContext();
+  for (unsigned Bits : {8, 16, 32, 64}) {
+    Type *Ty = Type::getIntNTy(C, Bits);
+    for (unsigned Op : {Instruction::Add, Instruction::Mul, Instruction::And})
+      OS << toUnits(TTI.getArithmeticInstrCost(Op, Ty, CostKind)) << ',';
+    OS << toUnits(TTI.getCmpSelInstrCost(Instruction::ICmp, Ty,
+                                         Type::getInt1Ty(C),
+                                         CmpInst::BAD_ICMP_PREDICATE, CostKind))
+       << ',';
+  }
+  OS << getBranchLatency(TTI);
+  return S;
+}
+
+// !obf.cost !{i64 Original, i64 Used}, both in thousandths of a cycle per
+// call.
+static bool readCostMD(const Function &F, uint64_t &Original, uint64_t &Used) {
+  MDNode *N = F.getMetadata("obf.cost");
+  if (!N || N->getNumOperands() != 2)
+    return false;
+  auto *O = mdconst::dyn_extract<ConstantInt>(N->getOperand(0));
+  auto *U = mdconst::dyn_extract<ConstantInt>(N->getOperand(1));
+  if (!O || !U)
+    return false;
+  Original = O->getZExtValue();
+  Used = U->getZExtValue();
+  return true;
+}
+
+obf::CostBudget::CostBudget(Function &F, unsigned Percent,
+                            const TargetTransformInfo &TTI,
+                            BlockFrequencyInfo &BFI)
+    : F(F), TTI(TTI), BFI(BFI),
+      EntryFreq(std::max<uint64_t>(
+          BFI.getBlockFreq(&F.getEntryBlock()).getFrequency(), 1)) {
+  if (!readCostMD(F, Original, Used)) {
+    // The first cycle sees the function as written.
+    for (BasicBlock &BB : F)
+      for (Instruction &I : BB)
+        Original += weigh(BB, getLatency(TTI, I));
+  }
+  Limit = Original * Percent / 100;
+}
+
+double obf::CostBudget::weight(const BasicBlock &BB) const {
+  auto It = Weights.find(&BB);
+  if (It != Weights.end())
+    return It->second;
+  // Blocks created this cycle are unknown to BFI and weigh 0, which is
+  // right for bogus blocks; split-off blocks are registered by inherit().
+  return (double)BFI.getBlockFreq(&BB).getFrequency() / EntryFreq;
+}
+
+uint64_t obf::CostBudget::weigh(const BasicBlock &BB, uint64_t Cost) const {
+  double Units = weight(BB) * Cost * 1000;
+  return Units < 1e18 ? (uint64_t)Units : (uint64_t)1e18;
+}
+
+bool obf::CostBudget::spend(const BasicBlock &BB, uint64_t Cost) {
+  uint64_t Units = weigh(BB, Cost);
+  if (Units > Limit - std::min(Used, Limit))
+    return false;
+  Used += Units;
+  return true;
+}
+
+void obf::CostBudget::inherit(const BasicBlock &New, const BasicBlock &From) {
+  Weights[&New] = weight(From);
+}
+
+unsigned obf::CostBudget::percentUsed() const {
+  if (!Limit)
+    return Used ? 100 : 0;
+  return (unsigned)std::min<uint64_t>(Used * 100 / Limit, 100);
+}
+
+void obf::CostBudget::save() {
+  LLVMContext &C = F.getContext();
+  Type *I64 = Type::getInt64Ty(C);
+  F.setMetadata("obf.cost",
+                MDNode::get(C, {ConstantAsMetadata::get(
+                                    ConstantInt::get(I64, Original)),
+                                ConstantAsMetadata::get(
+                                    ConstantInt::get(I64, Used))}));
+}
+
+uint64_t obf::CostBudget::nopCost() const {
+  return toUnits(TTI.getArithmeticInstrCost(
+      Instruction::Add, Type::getInt32Ty(F.getContext()), CostKind));
+}
+
+uint64_t obf::CostBudget::fakeLoopCost() const {
+  LLVMContext &C = F.getContext();
+  Type *I32 = Type::getInt32Ty(C);
+  // The jump into the loop, the increment, the compare and the latch; the
+  // back edge is never taken.
+  return toUnits(TTI.getArithmeticInstrCost(Instruction::Add, I32, CostKind) +
+                 TTI.getCmpSelInstrCost(Instruction::ICmp, I32,
+                                        Type::getInt1Ty(C),
+                                        CmpInst::BAD_ICMP_PREDICATE, CostKind) +
+                 2 * TTI.getCFInstrCost(Instruction::Br, CostKind));
+}
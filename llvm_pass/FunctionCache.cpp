@@ -0,0 +1,256 @@
+#include "ObfuscationPass.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA256.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+using namespace llvm;
+
+// Bump whenever the transforms emit something different for the same input.
+static constexpr StringLiteral CacheVersion = "obf-cache-10";
+
+// The options that shape the per-function transforms.
+static std::string describeOptions(const obf::ObfuscationOptions &O) {
+  return formatv("{0};bogus={1};nops={2};flatten={3};max-growth={4};seed={5};"
+                 "budget={6};bogus-loops={7}",
+                 CacheVersion, O.bogusBlocksPerFunction, O.insertNops,
+                 O.enableFlatten, O.maxGrowth, O.seed, O.costBudget,
+                 O.bogusInLoops)
+      .str();
+}
+
+// The target F is costed for. Clang records the CPU and features on every
+// function, but opt's -mcpu/-mattr only reach TTI through its
+// TargetMachine, so what TTI answers is part of it too.
+static std::string describeTarget(const Function &F,
+                                  const TargetTransformInfo *TTI) {
+  return formatv("cpu={0};features={1};latencies={2}",
+                 F.getFnAttribute("target-cpu").getValueAsString(),
+                 F.getFnAttribute("target-features").getValueAsString(),
+                 TTI ? obf::describeLatencies(*TTI, F) : "")
+      .str();
+}
+
+// Declares in CM every global value reachable from C and maps it in VMap.
+// False if C refers to something a standalone copy of Self cannot carry.
+static bool declareGlobals(const Constant *C, const Function &Self, Module &CM,
+                           ValueToValueMapTy &VMap,
+                           SmallPtrSetImpl<const Constant *> &Visited) {
+  if (!Visited.insert(C).second || VMap.count(C))
+    return true;
+  if (auto *BA = dyn_cast<BlockAddress>(C))
+    return BA->getFunction() == &Self;
+  if (auto *GV = dyn_cast<GlobalValue>(C)) {
+    if (!GV->hasName())
+      return false;
+    GlobalValue *Decl;
+    if (auto *FTy = dyn_cast<FunctionType>(GV->getValueType()))
+      Decl = Function::Create(FTy, GlobalValue::ExternalLinkage,
+                              GV->getAddressSpace(), GV->getName(), &CM);
+    else
+      Decl = new GlobalVariable(CM, GV->getValueType(), /*isConstant=*/false,
+                                GlobalValue::ExternalLinkage, nullptr,
+                                GV->getName(), nullptr,
+                                GV->getThreadLocalMode(),
+                                GV->getAddressSpace());
+    VMap[GV] = Decl;
+    return true;
+  }
+  for (const Value *Op : C->operands())
+    if (!declareGlobals(cast<Constant>(Op), Self, CM, VMap, Visited))
+      return false;
+  return true;
+}
+
+// Cloning into another module always creates !llvm.dbg.cu, even when the
+// function has no debug info to carry over.
+static void dropEmptyCompileUnits(Module &M) {
+  NamedMDNode *CUs = M.getNamedMetadata("llvm.dbg.cu");
+  if (CUs && CUs->getNumOperands() == 0)
+    M.eraseNamedMetadata(CUs);
+}
+
+// Copies F into a module of its own, next to declarations of the globals it
+// references. Returns null if F cannot be copied faithfully.
+static std::unique_ptr<Module> extractFunction(const Function &F) {
+  if (!F.hasName() || F.getSubprogram() || F.hasPrefixData() ||
+      F.hasPrologueData())
+    return nullptr;
+  const Module &M = *F.getParent();
+  auto CM = std::make_unique<Module>("obf-cache", F.getContext());
+  CM->setTargetTriple(M.getTargetTriple());
+  CM->setDataLayout(M.getDataLayout());
+  Function *NF = Function::Create(F.getFunctionType(),
+                                  GlobalValue::ExternalLinkage,
+                                  F.getAddressSpace(), F.getName(), CM.get());
+  ValueToValueMapTy VMap;
+  VMap[&F] = NF;
+  SmallPtrSet<const Constant *, 32> Visited;
+  if (F.hasPersonalityFn() &&
+      !declareGlobals(F.getPersonalityFn(), F, *CM, VMap, Visited))
+    return nullptr;
+  for (const Instruction &I : instructions(F))
+    for (const Value *Op : I.operands())
+      if (auto *C = dyn_cast<Constant>(Op))
+        if (!declareGlobals(C, F, *CM, VMap, Visited))
+          return nullptr;
+  Function::arg_iterator NArg = NF->arg_begin();
+  for (const Argument &A : F.args())
+    VMap[&A] = &*NArg++;
+  SmallVector<ReturnInst *, 4> Returns;
+  CloneFunctionInto(NF, &F, VMap, CloneFunctionChangeType::DifferentModule,
+                    Returns);
+  dropEmptyCompileUnits(*CM);
+  return CM;
+}
+
+static std::string entryPath(StringRef Dir, StringRef Key) {
+  SmallString<128> Path(Dir);
+  sys::path::append(Path, "obf-" + Key + ".bc");
+  return std::string(Path);
+}
+
+std::optional<std::string>
+obf::FunctionCache::key(const Function &F, const ObfuscationOptions &FnOpts,
+                        const TargetTransformInfo *TTI) const {
+  // The result would reference functions the cache entry does not hold.
+  if (FnOpts.outlineBogus)
+    return std::nullopt;
+  std::unique_ptr<Module> CM = extractFunction(F);
+  if (!CM)
+    return std::nullopt;
+  SmallString<0> Buf;
+  raw_svector_ostream OS(Buf);
+  WriteBitcodeToFile(*CM, OS);
+  Buf += describeOptions(FnOpts);
+  Buf += describeTarget(F, TTI);
+  Buf += describeHotness(*F.getParent(), FnOpts);
+  return toHex(SHA256::hash(arrayRefFromStringRef(Buf)), /*LowerCase=*/true);
+}
+
+bool obf::FunctionCache::restore(Function &F, StringRef Key,
+                                 const ObfuscationOptions &FnOpts,
+                                 ObfuscationStats &S) const {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buf =
+      MemoryBuffer::getFile(entryPath(Dir, Key));
+  if (!Buf)
+    return false;
+  Expected<std::unique_ptr<Module>> CM =
+      parseBitcodeFile((*Buf)->getMemBufferRef(), F.getContext());
+  if (!CM) {
+    consumeError(CM.takeError());
+    return false;
+  }
+  Function *CF = (*CM)->getFunction(F.getName());
+  NamedMDNode *Counters = (*CM)->getNamedMetadata("obf.stats");
+  if (!CF || CF->isDeclaration() ||
+      CF->getFunctionType() != F.getFunctionType() || !Counters ||
+      Counters->getNumOperands() != 1 ||
+      Counters->getOperand(0)->getNumOperands() != 11)
+    return false;
+
+  // Every declaration must resolve to the same global in F's module.
+  ValueToValueMapTy VMap;
+  VMap[CF] = &F;
+  Module &M = *F.getParent();
+  SmallVector<GlobalValue *, 2> Missing;
+  for (GlobalValue &GV : (*CM)->global_values()) {
+    if (&GV == CF)
+      continue;
+    GlobalValue *Target = M.getNamedValue(GV.getName());
+    if (!Target) {
+      Missing.push_back(&GV);
+      continue;
+    }
+    if (Target->getValueType() != GV.getValueType())
+      return false;
+    VMap[&GV] = Target;
+  }
+  // Globals the transforms create on first use, once the rest resolved.
+  for (GlobalValue *GV : Missing) {
+    GlobalValue *Target = getOwnedGlobal(M, GV->getName(), FnOpts.seed);
+    if (!Target || Target->getValueType() != GV->getValueType())
+      return false;
+    VMap[GV] = Target;
+  }
+  Function::arg_iterator FArg = F.arg_begin();
+  for (const Argument &A : CF->args())
+    VMap[&A] = &*FArg++;
+
+  for (BasicBlock &BB : F)
+    BB.dropAllReferences();
+  while (!F.empty())
+    F.begin()->eraseFromParent();
+  F.clearMetadata();
+  SmallVector<ReturnInst *, 4> Returns;
+  CloneFunctionInto(&F, CF, VMap, CloneFunctionChangeType::DifferentModule,
+                    Returns);
+  dropEmptyCompileUnits(M);
+
+  MDNode *N = Counters->getOperand(0);
+  auto Counter = [&](unsigned I) {
+    return (unsigned)mdconst::extract<ConstantInt>(N->getOperand(I))
+        ->getZExtValue();
+  };
+  S.bogusBlocks = Counter(0);
+  S.nops = Counter(1);
+  S.fakeLoops = Counter(2);
+  S.growthCapped = Counter(3);
+  S.hotBlocks = Counter(4);
+  S.budgetUsed = Counter(5);
+  S.budgetExhausted = Counter(6);
+  S.aluPredicates = Counter(7);
+  S.algebraicPredicates = Counter(8);
+  S.statePredicates = Counter(9);
+  S.predicateLatency = Counter(10);
+  S.fromCache = true;
+  return true;
+}
+
+void obf::FunctionCache::store(const Function &F, StringRef Key,
+                               const ObfuscationStats &S) const {
+  std::unique_ptr<Module> CM = extractFunction(F);
+  if (!CM)
+    return;
+  LLVMContext &C = F.getContext();
+  Type *I32 = Type::getInt32Ty(C);
+  CM->getOrInsertNamedMetadata("obf.stats")
+      ->addOperand(MDTuple::get(
+          C, {ConstantAsMetadata::get(ConstantInt::get(I32, S.bogusBlocks)),
+              ConstantAsMetadata::get(ConstantInt::get(I32, S.nops)),
+              ConstantAsMetadata::get(ConstantInt::get(I32, S.fakeLoops)),
+              ConstantAsMetadata::get(ConstantInt::get(I32, S.growthCapped)),
+              ConstantAsMetadata::get(ConstantInt::get(I32, S.hotBlocks)),
+              ConstantAsMetadata::get(ConstantInt::get(I32, S.budgetUsed)),
+              ConstantAsMetadata::get(ConstantInt::get(I32, S.budgetExhausted)),
+              ConstantAsMetadata::get(ConstantInt::get(I32, S.aluPredicates)),
+              ConstantAsMetadata::get(
+                  ConstantInt::get(I32, S.algebraicPredicates)),
+              ConstantAsMetadata::get(ConstantInt::get(I32, S.statePredicates)),
+              ConstantAsMetadata::get(
+                  ConstantInt::get(I32, S.predicateLatency))}));
+
+  // Write to a unique temporary and rename, so concurrent writers of the
+  // same entry never expose a partial file.
+  if (sys::fs::create_directories(Dir))
+    return;
+  std::string Path = entryPath(Dir, Key);
+  int FD;
+  SmallString<128> TmpPath;
+  if (sys::fs::createUniqueFile(Path + ".tmp%%%%%%", FD, TmpPath))
+    return;
+  {
+    raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    WriteBitcodeToFile(*CM, OS);
+  }
+  if (sys::fs::rename(TmpPath, Path))
+    sys::fs::remove(TmpPath);
+}
@@ -0,0 +1,394 @@
+// obf-lazy: obfuscates a bitcode file without ever holding all of its
+// function bodies in memory.
+//
+// The module is opened lazily, so only globals and declarations are read up
+// front. String encryption runs on that skeleton; then functions are
+// materialized, obfuscated and collected into chunks of about -chunk-insts
+// instructions. Each full chunk is copied into a module of its own, next to
+// declarations of only what it references, written out, and its bodies are
+// deleted from the source module before the next one is read, so peak
+// memory follows the chunk size rather than the module.
+//
+// The output directory gets globals.bc (global variables, aliases and the
+// generated constructors) and part-N.bc per chunk. Local symbols are
+// promoted to hidden globals with a per-input suffix first, so every file
+// compiles on its own and the objects link like a single translation unit.
+//
+//   obf-lazy -obf='bogus=2;nops=4;strings=1' input.bc -o parts/
+#include "ObfuscationPass.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LLVMRemarkStreamer.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Remarks/RemarkSerializer.h"
+#include "llvm/Remarks/RemarkStreamer.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/WithColor.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include <vector>
+
+using namespace llvm;
+
+static cl::opt<std::string> InputFilename(cl::Positional, cl::Required,
+                                          cl::desc("<input bitcode>"));
+static cl::opt<std::string> OutputDir("o", cl::Required,
+                                      cl::desc("Output directory"));
+static cl::opt<std::string>
+    ObfParams("obf", cl::init(""),
+              cl::desc("Parameters as for obf<...>, e.g. 'bogus=2;nops=4'"));
+static cl::opt<unsigned>
+    ChunkInsts("chunk-insts", cl::init(50000),
+               cl::desc("Instructions per output chunk (before obfuscation)"));
+static cl::opt<unsigned> Cycles("cycles", cl::init(1),
+                                cl::desc("Obfuscation cycles per function"));
+static cl::opt<bool> Verbose("v", cl::desc("Report every chunk written"));
+static cl::opt<std::string>
+    RemarksFile("remarks", cl::desc("Write the obfuscation remarks (YAML) "
+                                    "to this file"));
+
+static ExitOnError ExitOnErr;
+
+// Gives every local global value a unique external name, hidden from other
+// DSOs, so a definition can live in a different file than its users.
+static void promoteLocals(Module &M, StringRef Suffix) {
+  unsigned Anon = 0;
+  for (GlobalValue &GV : M.global_values()) {
+    if (!GV.hasLocalLinkage() || GV.getName().starts_with("llvm."))
+      continue;
+    std::string Name = GV.hasName() ? GV.getName().str()
+                                    : formatv("__obf.anon.{0}", Anon++).str();
+    GV.setName(Name + ".obf." + Suffix);
+    GV.setLinkage(GlobalValue::ExternalLinkage);
+    GV.setVisibility(GlobalValue::HiddenVisibility);
+  }
+}
+
+// The object whose file GV is defined in: aliases and ifuncs must sit next
+// to what they point at.
+static const GlobalObject *homeOf(const GlobalValue *GV) {
+  if (auto *GI = dyn_cast<GlobalIFunc>(GV))
+    return GI->getResolverFunction();
+  return GV->getAliaseeObject();
+}
+
+// Creates in Chunk an empty global value like GV: with GV's linkage if it is
+// to be defined there, as an external reference otherwise.
+static GlobalValue *copyGlobal(Module &Chunk, const GlobalValue &GV,
+                               bool Define) {
+  GlobalValue::LinkageTypes Linkage = Define || GV.isDeclaration()
+                                          ? GV.getLinkage()
+                                          : GlobalValue::ExternalLinkage;
+  GlobalValue *NGV;
+  if (auto *F = dyn_cast<Function>(&GV)) {
+    Function *NF = Function::Create(F->getFunctionType(), Linkage,
+                                    F->getAddressSpace(), F->getName(), &Chunk);
+    NF->copyAttributesFrom(F);
+    if (!Define) {
+      NF->setPersonalityFn(nullptr);
+      NF->setPrefixData(nullptr);
+      NF->setPrologueData(nullptr);
+    }
+    NGV = NF;
+  } else if (auto *Var = dyn_cast<GlobalVariable>(&GV)) {
+    auto *NV = new GlobalVariable(
+        Chunk, Var->getValueType(), Var->isConstant(), Linkage, nullptr,
+        Var->getName(), nullptr, Var->getThreadLocalMode(),
+        Var->getAddressSpace());
+    NV->copyAttributesFrom(Var);
+    NGV = NV;
+  } else if (Define && isa<GlobalAlias>(GV)) {
+    auto *NA = GlobalAlias::create(GV.getValueType(), GV.getAddressSpace(),
+                                   Linkage, GV.getName(), &Chunk);
+    NA->copyAttributesFrom(cast<GlobalAlias>(&GV));
+    NGV = NA;
+  } else if (Define) {
+    auto *NI = GlobalIFunc::create(GV.getValueType(), GV.getAddressSpace(),
+                                   Linkage, GV.getName(), nullptr, &Chunk);
+    NI->copyAttributesFrom(cast<GlobalIFunc>(&GV));
+    NGV = NI;
+  } else {
+    // An alias or ifunc defined in another file.
+    if (auto *FTy = dyn_cast<FunctionType>(GV.getValueType()))
+      NGV = Function::Create(FTy, Linkage, GV.getAddressSpace(), GV.getName(),
+                             &Chunk);
+    else
+      NGV = new GlobalVariable(Chunk, GV.getValueType(), /*isConstant=*/false,
+                               Linkage, nullptr, GV.getName(), nullptr,
+                               GV.getThreadLocalMode(), GV.getAddressSpace());
+    NGV->setVisibility(GV.getVisibility());
+    NGV->setDLLStorageClass(GV.getDLLStorageClass());
+  }
+  auto *GO = dyn_cast<GlobalObject>(&GV);
+  if (Define && GO && GO->hasComdat()) {
+    const Comdat *C = GO->getComdat();
+    Comdat *NC = Chunk.getOrInsertComdat(C->getName());
+    NC->setSelectionKind(C->getSelectionKind());
+    cast<GlobalObject>(NGV)->setComdat(NC);
+  }
+  return NGV;
+}
+
+// Declares in Chunk every global value C refers to that VMap does not map
+// yet, and maps it.
+static void declareReferenced(const Constant *C, Module &Chunk,
+                              ValueToValueMapTy &VMap,
+                              SmallPtrSetImpl<const Constant *> &Visited) {
+  if (!Visited.insert(C).second || VMap.count(C))
+    return;
+  if (auto *BA = dyn_cast<BlockAddress>(C))
+    return declareReferenced(BA->getFunction(), Chunk, VMap, Visited);
+  if (auto *GV = dyn_cast<GlobalValue>(C)) {
+    VMap[GV] = copyGlobal(Chunk, *GV, /*Define=*/false);
+    return;
+  }
+  for (const Value *Op : C->operands())
+    declareReferenced(cast<Constant>(Op), Chunk, VMap, Visited);
+}
+
+// Copies the definitions Defs out of M into a module of their own, next to
+// declarations of only what they reference, verifies it and writes it to
+// Path. Globals marks globals.bc, which also gets the module asm and the
+// compile units; a function chunk gets those of its own functions.
+static void writeChunk(const Module &M, StringRef Path, bool Globals,
+                       ArrayRef<const GlobalValue *> Defs) {
+  auto Chunk =
+      std::make_unique<Module>(M.getModuleIdentifier(), M.getContext());
+  Chunk->setSourceFileName(M.getSourceFileName());
+  Chunk->setDataLayout(M.getDataLayout());
+  Chunk->setTargetTriple(M.getTargetTriple());
+  if (Globals)
+    Chunk->setModuleInlineAsm(M.getModuleInlineAsm());
+
+  ValueToValueMapTy VMap;
+  for (const GlobalValue *GV : Defs)
+    VMap[GV] = copyGlobal(*Chunk, *GV, /*Define=*/true);
+  SmallPtrSet<const Constant *, 32> Visited;
+  auto Declare = [&](const Constant *C) {
+    declareReferenced(C, *Chunk, VMap, Visited);
+  };
+  for (const GlobalValue *GV : Defs) {
+    if (auto *F = dyn_cast<Function>(GV)) {
+      if (F->hasPersonalityFn())
+        Declare(F->getPersonalityFn());
+      if (F->hasPrefixData())
+        Declare(F->getPrefixData());
+      if (F->hasPrologueData())
+        Declare(F->getPrologueData());
+      for (const Instruction &I : instructions(*F))
+        for (const Value *Op : I.operands())
+          if (auto *C = dyn_cast<Constant>(Op))
+            Declare(C);
+          else if (auto *MV = dyn_cast<MetadataAsValue>(Op))
+            if (auto *CM = dyn_cast<ConstantAsMetadata>(MV->getMetadata()))
+              Declare(CM->getValue());
+    } else if (auto *Var = dyn_cast<GlobalVariable>(GV)) {
+      Declare(Var->getInitializer());
+    } else if (auto *GA = dyn_cast<GlobalAlias>(GV)) {
+      Declare(GA->getAliasee());
+    } else {
+      Declare(cast<GlobalIFunc>(GV)->getResolver());
+    }
+  }
+
+  // Cloning a function adds its compile units to !llvm.dbg.cu.
+  for (const NamedMDNode &NMD : M.named_metadata()) {
+    if (!Globals && NMD.getName() == "llvm.dbg.cu")
+      continue;
+    NamedMDNode *NewNMD = Chunk->getOrInsertNamedMetadata(NMD.getName());
+    for (const MDNode *Op : NMD.operands())
+      NewNMD->addOperand(MapMetadata(Op, VMap, RF_NullMapMissingGlobalValues));
+  }
+  for (const GlobalValue *GV : Defs) {
+    if (auto *F = dyn_cast<Function>(GV)) {
+      auto *NF = cast<Function>(VMap[F]);
+      Function::arg_iterator NArg = NF->arg_begin();
+      for (const Argument &A : F->args()) {
+        NArg->setName(A.getName());
+        VMap[&A] = &*NArg++;
+      }
+      SmallVector<ReturnInst *, 4> Returns;
+      CloneFunctionInto(NF, F, VMap, CloneFunctionChangeType::DifferentModule,
+                        Returns);
+    } else if (auto *Var = dyn_cast<GlobalVariable>(GV)) {
+      auto *NV = cast<GlobalVariable>(VMap[Var]);
+      NV->setInitializer(MapValue(Var->getInitializer(), VMap));
+      SmallVector<std::pair<unsigned, MDNode *>, 1> MDs;
+      Var->getAllMetadata(MDs);
+      for (const auto &[Kind, MD] : MDs)
+        NV->addMetadata(Kind, *MapMetadata(MD, VMap));
+    } else if (auto *GA = dyn_cast<GlobalAlias>(GV)) {
+      cast<GlobalAlias>(VMap[GA])->setAliasee(MapValue(GA->getAliasee(), VMap));
+    } else {
+      auto *GI = cast<GlobalIFunc>(GV);
+      cast<GlobalIFunc>(VMap[GI])->setResolver(
+          MapValue(GI->getResolver(), VMap));
+    }
+  }
+  // Even a function without debug info leaves an empty one behind.
+  NamedMDNode *CUs = Chunk->getNamedMetadata("llvm.dbg.cu");
+  if (CUs && CUs->getNumOperands() == 0)
+    Chunk->eraseNamedMetadata(CUs);
+  if (verifyModule(*Chunk, &errs()))
+    ExitOnErr(createStringError(inconvertibleErrorCode(),
+                                "invalid output chunk " + Path));
+
+  std::error_code EC;
+  ToolOutputFile Out(Path, EC, sys::fs::OF_None);
+  ExitOnErr(errorCodeToError(EC));
+  WriteBitcodeToFile(*Chunk, Out.os());
+  Out.keep();
+}
+
+// Sends the "obfuscation" remarks of Ctx to OS as YAML.
+static void streamRemarks(LLVMContext &Ctx, raw_ostream &OS) {
+  std::unique_ptr<remarks::RemarkSerializer> Serializer =
+      ExitOnErr(remarks::createRemarkSerializer(
+          remarks::Format::YAML, remarks::SerializerMode::Separate, OS));
+  auto Streamer =
+      std::make_unique<remarks::RemarkStreamer>(std::move(Serializer));
+  ExitOnErr(Streamer->setFilter("obfuscation"));
+  Ctx.setMainRemarkStreamer(std::move(Streamer));
+  Ctx.setLLVMRemarkStreamer(
+      std::make_unique<LLVMRemarkStreamer>(*Ctx.getMainRemarkStreamer()));
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  cl::ParseCommandLineOptions(argc, argv, "lazy bounded-memory obfuscator\n");
+  ExitOnErr.setBanner("obf-lazy: ");
+  obf::ObfuscationOptions Opts =
+      ExitOnErr(obf::parseObfuscationOptions(ObfParams));
+
+  std::unique_ptr<MemoryBuffer> Buffer =
+      ExitOnErr(errorOrToExpected(MemoryBuffer::getFileOrSTDIN(InputFilename)));
+  MD5 Hasher;
+  Hasher.update(Buffer->getBuffer());
+  MD5::MD5Result Hash;
+  Hasher.final(Hash);
+  std::string Suffix = utohexstr(Hash.low(), /*LowerCase=*/true);
+
+  LLVMContext Ctx;
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = getLazyIRModule(std::move(Buffer), Err, Ctx);
+  if (!M) {
+    Err.print(argv[0], errs());
+    return 1;
+  }
+  ExitOnErr(errorCodeToError(sys::fs::create_directories(OutputDir)));
+  std::optional<ToolOutputFile> Remarks;
+  if (!RemarksFile.empty()) {
+    std::error_code EC;
+    Remarks.emplace(RemarksFile, EC, sys::fs::OF_Text);
+    ExitOnErr(errorCodeToError(EC));
+    streamRemarks(Ctx, Remarks->os());
+  }
+
+  // Strings live in the (already loaded) globals; uses inside bodies that
+  // are still on disk follow the replacement when they are read. Function
+  // attributes are loaded too, so the scope can be resolved up front.
+  obf::applyObfuscationScope(*M, Opts);
+  obf::runStringObfuscation(*M, Opts);
+  obf::stripStringKey(*M);
+  promoteLocals(*M, Suffix);
+
+  PassBuilder PB;
+  FunctionAnalysisManager FAM;
+  PB.registerFunctionAnalyses(FAM);
+  std::optional<ProfileSummaryInfo> PSI;
+  if (M->getProfileSummary(/*IsCS=*/false))
+    PSI.emplace(*M);
+
+  // Aliases and ifuncs go into the file of what they point at.
+  DenseMap<const GlobalObject *, SmallVector<const GlobalValue *, 1>> Aliases;
+  for (const GlobalAlias &GA : M->aliases())
+    if (const GlobalObject *Home = homeOf(&GA))
+      Aliases[Home].push_back(&GA);
+  for (const GlobalIFunc &GI : M->ifuncs())
+    if (const GlobalObject *Home = homeOf(&GI))
+      Aliases[Home].push_back(&GI);
+
+  std::vector<Function *> Pending;
+  uint64_t PendingInsts = 0, TotalInsts = 0;
+  unsigned NumChunks = 0;
+  auto Flush = [&] {
+    if (Pending.empty())
+      return;
+    std::vector<const GlobalValue *> Defs(Pending.begin(), Pending.end());
+    for (Function *F : Pending) {
+      auto It = Aliases.find(F);
+      if (It != Aliases.end())
+        Defs.insert(Defs.end(), It->second.begin(), It->second.end());
+    }
+    SmallString<128> Path(OutputDir);
+    sys::path::append(Path, formatv("part-{0}.bc", NumChunks++));
+    writeChunk(*M, Path, /*Globals=*/false, Defs);
+    if (Verbose)
+      errs() << formatv("obf-lazy: {0}: {1} functions, {2} instructions\n",
+                        Path, Pending.size(), PendingInsts);
+    for (Function *F : Pending) {
+      FAM.clear(*F, F->getName());
+      F->deleteBody();
+    }
+    Pending.clear();
+    PendingInsts = 0;
+  };
+
+  for (Function &F : *M) {
+    // Generated functions (the string constructor) stay with the globals.
+    if (F.isDeclaration() || obf::isObfuscation(F))
+      continue;
+    ExitOnErr(F.materialize());
+    PendingInsts += F.getInstructionCount();
+    TotalInsts += F.getInstructionCount();
+    for (unsigned I = 0; I < Cycles; ++I) {
+      obf::ObfuscationStats S;
+      FAM.invalidate(F, obf::obfuscateFunction(F, Opts, FAM,
+                                               PSI ? &*PSI : nullptr,
+                                               /*RegionTimers=*/true, S));
+    }
+    Pending.push_back(&F);
+    // Outlined bogus bodies are local to F's chunk.
+    for (Instruction &I : instructions(F))
+      if (auto *CB = dyn_cast<CallBase>(&I))
+        if (Function *Callee = CB->getCalledFunction())
+          if (Callee->hasLocalLinkage() && obf::isObfuscation(*Callee) &&
+              !Callee->isDeclaration())
+            Pending.push_back(Callee);
+    if (PendingInsts >= ChunkInsts)
+      Flush();
+  }
+  Flush();
+
+  // What is left to define: variables, aliases, ifuncs and our own
+  // constructors; module asm goes here exactly once.
+  SmallString<128> Path(OutputDir);
+  sys::path::append(Path, "globals.bc");
+  std::vector<const GlobalValue *> Defs;
+  for (const GlobalValue &GV : M->global_values()) {
+    const GlobalObject *Home = homeOf(&GV);
+    if (GV.isDeclaration() || !Home)
+      continue;
+    if (auto *F = dyn_cast<Function>(Home); !F || obf::isObfuscation(*F))
+      Defs.push_back(&GV);
+  }
+  writeChunk(*M, Path, /*Globals=*/true, Defs);
+  if (Verbose)
+    errs() << formatv("obf-lazy: {0} instructions in {1} chunks\n",
+                      TotalInsts, NumChunks);
+  if (Remarks)
+    Remarks->keep();
+  return 0;
+}
@@ -0,0 +1,313 @@
+// obf-cc: compiles C/C++ sources to an obfuscated binary in one process.
+//
+// Each source is parsed and optimized by the clang libraries straight into
+// an llvm::Module, obfuscated by the obf<...> pipeline through the same
+// PassBuilder callbacks the plugin registers, and lowered to an in-memory
+// object by a TargetMachine created once for the whole run. Only the final
+// link runs outside the process.
+//
+//   obf-cc -obf='bogus=2;nops=4;strings=1' -cycles=2 hello.c -o hello
+//   obf-cc -c -O2 a.c b.cpp -time-stages
+#include "ObfuscationPass.h"
+#include "clang/Basic/DiagnosticOptions.h"
+#include "clang/CodeGen/CodeGenAction.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/CompilerInvocation.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Frontend/Utils.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LLVMRemarkStreamer.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Remarks/RemarkSerializer.h"
+#include "llvm/Remarks/RemarkStreamer.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/TargetParser/Host.h"
+#include <chrono>
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<std::string> Inputs(cl::Positional, cl::OneOrMore,
+                                    cl::desc("<sources>"));
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output file"));
+static cl::opt<bool> CompileOnly("c", cl::desc("Write objects, do not link"));
+static cl::opt<std::string>
+    ObfParams("obf", cl::init(""),
+              cl::desc("Parameters as for obf<...>, e.g. 'bogus=2;nops=4'"));
+static cl::opt<unsigned> Cycles("cycles", cl::init(1),
+                                cl::desc("Obfuscation cycles"));
+static cl::opt<char> OptLevel("O", cl::Prefix, cl::init('1'),
+                              cl::desc("Optimization level (0-3)"));
+static cl::opt<std::string> TargetTriple("target",
+                                         cl::desc("Target triple (default: "
+                                                  "host)"));
+static cl::list<std::string>
+    FrontendArgs("Xcc", cl::desc("Pass an argument to the clang frontend"));
+static cl::list<std::string>
+    LinkerArgs("Xlink", cl::desc("Pass an argument to the linker driver"));
+static cl::opt<std::string> LinkerDriver("linker", cl::init("clang++"),
+                                         cl::desc("Driver used to link"));
+static cl::opt<std::string>
+    ResourceDir("resource-dir", cl::init(OBF_CLANG_RESOURCE_DIR),
+                cl::desc("clang resource directory (builtin headers)"));
+static cl::opt<std::string>
+    RemarksFile("remarks", cl::desc("Write the obfuscation remarks (YAML) "
+                                    "of every source to this file"));
+static cl::opt<bool> TimeStages("time-stages",
+                                cl::desc("Print the time spent per stage"));
+static cl::opt<std::string>
+    StageReport("stage-report", cl::desc("Write per-stage times as JSON"));
+
+static ExitOnError ExitOnErr;
+
+namespace {
+// Wall time per stage, summed over all sources.
+struct StageTimes {
+  double Parse = 0, Obfuscate = 0, CodeGen = 0, Link = 0;
+};
+
+class StageTimer {
+  double &Total;
+  std::chrono::steady_clock::time_point Start;
+
+public:
+  explicit StageTimer(double &Total)
+      : Total(Total), Start(std::chrono::steady_clock::now()) {}
+  ~StageTimer() {
+    Total += std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                           Start)
+                 .count();
+  }
+};
+} // namespace
+
+// Runs the clang frontend and its -O pipeline on Src into a module in Ctx.
+static std::unique_ptr<Module> parseSource(StringRef Src, StringRef Triple,
+                                           LLVMContext &Ctx) {
+  std::vector<std::string> ArgStrs = {"clang",
+                                      "-c",
+                                      Src.str(),
+                                      std::string("-O") + OptLevel.getValue(),
+                                      "-target",
+                                      Triple.str(),
+                                      "-resource-dir",
+                                      ResourceDir};
+  ArgStrs.insert(ArgStrs.end(), FrontendArgs.begin(), FrontendArgs.end());
+  std::vector<const char *> Args;
+  for (const std::string &A : ArgStrs)
+    Args.push_back(A.c_str());
+
+  IntrusiveRefCntPtr<clang::DiagnosticOptions> DiagOpts =
+      new clang::DiagnosticOptions();
+  IntrusiveRefCntPtr<clang::DiagnosticsEngine> Diags =
+      clang::CompilerInstance::createDiagnostics(
+          *vfs::getRealFileSystem(), DiagOpts.get(),
+          new clang::TextDiagnosticPrinter(errs(), DiagOpts.get()));
+  clang::CreateInvocationOptions CIOpts;
+  CIOpts.Diags = Diags;
+  std::unique_ptr<clang::CompilerInvocation> Invocation =
+      clang::createInvocation(Args, CIOpts);
+  if (!Invocation)
+    return nullptr;
+
+  clang::CompilerInstance CI;
+  CI.setInvocation(std::move(Invocation));
+  CI.setDiagnostics(Diags.get());
+  clang::EmitLLVMOnlyAction Action(&Ctx);
+  if (!CI.ExecuteAction(Action))
+    return nullptr;
+  return Action.takeModule();
+}
+
+// Sends the "obfuscation" remarks of Ctx to OS, next to those of the other
+// sources.
+static void streamRemarks(LLVMContext &Ctx, raw_ostream &OS) {
+  std::unique_ptr<remarks::RemarkSerializer> Serializer =
+      ExitOnErr(remarks::createRemarkSerializer(
+          remarks::Format::YAML, remarks::SerializerMode::Separate, OS));
+  auto Streamer =
+      std::make_unique<remarks::RemarkStreamer>(std::move(Serializer));
+  ExitOnErr(Streamer->setFilter("obfuscation"));
+  Ctx.setMainRemarkStreamer(std::move(Streamer));
+  Ctx.setLLVMRemarkStreamer(
+      std::make_unique<LLVMRemarkStreamer>(*Ctx.getMainRemarkStreamer()));
+}
+
+static void obfuscate(Module &M, TargetMachine &TM) {
+  PassBuilder PB(&TM);
+  llvmGetPassPluginInfo().RegisterPassBuilderCallbacks(PB);
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  std::string Pipeline =
+      ObfParams.empty() ? "obf"
+                        : formatv("obf<{0}>", ObfParams.getValue()).str();
+  if (Cycles > 1)
+    Pipeline = formatv("repeat<{0}>({1})", Cycles.getValue(), Pipeline).str();
+  Pipeline += ",obf-strip-key";
+  ModulePassManager MPM;
+  ExitOnErr(PB.parsePassPipeline(MPM, Pipeline));
+  MPM.run(M, MAM);
+}
+
+static void emitObject(Module &M, TargetMachine &TM,
+                       SmallVectorImpl<char> &Object) {
+  M.setDataLayout(TM.createDataLayout());
+  raw_svector_ostream OS(Object);
+  legacy::PassManager PM;
+  if (TM.addPassesToEmitFile(PM, OS, nullptr, CodeGenFileType::ObjectFile))
+    ExitOnErr(createStringError(inconvertibleErrorCode(),
+                                "target cannot emit object files"));
+  PM.run(M);
+}
+
+static void writeFile(StringRef Path, ArrayRef<char> Data) {
+  std::error_code EC;
+  ToolOutputFile Out(Path, EC, sys::fs::OF_None);
+  ExitOnErr(errorCodeToError(EC));
+  Out.os().write(Data.data(), Data.size());
+  Out.keep();
+}
+
+static void link(ArrayRef<std::string> Objects, StringRef Output) {
+  std::string Driver =
+      ExitOnErr(errorOrToExpected(sys::findProgramByName(LinkerDriver)));
+  std::vector<StringRef> Args = {Driver};
+  Args.insert(Args.end(), Objects.begin(), Objects.end());
+  Args.push_back("-o");
+  Args.push_back(Output);
+  Args.insert(Args.end(), LinkerArgs.begin(), LinkerArgs.end());
+  std::string ErrMsg;
+  if (sys::ExecuteAndWait(Driver, Args, std::nullopt, {}, 0, 0, &ErrMsg))
+    ExitOnErr(createStringError(inconvertibleErrorCode(),
+                                "link failed" +
+                                    (ErrMsg.empty() ? "" : ": " + ErrMsg)));
+}
+
+static void reportStages(const StageTimes &T) {
+  double Total = T.Parse + T.Obfuscate + T.CodeGen + T.Link;
+  if (TimeStages)
+    errs() << formatv("obf-cc: parse {0:f3}s, obfuscate {1:f3}s, codegen "
+                      "{2:f3}s, link {3:f3}s, total {4:f3}s\n",
+                      T.Parse, T.Obfuscate, T.CodeGen, T.Link, Total);
+  if (!StageReport.empty()) {
+    std::error_code EC;
+    raw_fd_ostream OS(StageReport, EC);
+    ExitOnErr(errorCodeToError(EC));
+    OS << formatv("{{\"parse\": {0}, \"obfuscate\": {1}, \"codegen\": {2}, "
+                  "\"link\": {3}, \"total\": {4}}\n",
+                  T.Parse, T.Obfuscate, T.CodeGen, T.Link, Total);
+  }
+}
+
+int main(int argc, char **argv) {
+  InitLLVM X(argc, argv);
+  InitializeAllTargetInfos();
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+  InitializeAllAsmParsers();
+  cl::ParseCommandLineOptions(argc, argv, "in-process obfuscating compiler\n");
+  ExitOnErr.setBanner("obf-cc: ");
+  ExitOnErr(obf::parseObfuscationOptions(ObfParams).takeError());
+  if (CompileOnly && Inputs.size() > 1 && !OutputFilename.empty())
+    ExitOnErr(createStringError(inconvertibleErrorCode(),
+                                "-o with -c needs a single source"));
+
+  // One TargetMachine serves every source.
+  std::string TripleName = TargetTriple.empty()
+                               ? sys::getDefaultTargetTriple()
+                               : Triple::normalize(TargetTriple);
+  std::string Error;
+  const Target *TheTarget = TargetRegistry::lookupTarget(TripleName, Error);
+  if (!TheTarget)
+    ExitOnErr(createStringError(inconvertibleErrorCode(), Error));
+  std::optional<CodeGenOptLevel> Level =
+      CodeGenOpt::parseLevel(OptLevel.getValue());
+  if (!Level)
+    ExitOnErr(createStringError(inconvertibleErrorCode(),
+                                "invalid optimization level"));
+  std::unique_ptr<TargetMachine> TM(TheTarget->createTargetMachine(
+      TripleName, "generic", "", TargetOptions(), Reloc::PIC_, std::nullopt,
+      *Level));
+
+  std::optional<ToolOutputFile> Remarks;
+  if (!RemarksFile.empty()) {
+    std::error_code EC;
+    Remarks.emplace(RemarksFile, EC, sys::fs::OF_Text);
+    ExitOnErr(errorCodeToError(EC));
+  }
+
+  StageTimes Times;
+  std::vector<std::string> Objects;
+  for (const std::string &Src : Inputs) {
+    LLVMContext Ctx;
+    std::unique_ptr<Module> M;
+    {
+      StageTimer T(Times.Parse);
+      M = parseSource(Src, TripleName, Ctx);
+    }
+    if (!M)
+      return 1;
+    if (Remarks)
+      streamRemarks(Ctx, Remarks->os());
+    {
+      StageTimer T(Times.Obfuscate);
+      obfuscate(*M, *TM);
+    }
+    SmallVector<char, 0> Object;
+    {
+      StageTimer T(Times.CodeGen);
+      emitObject(*M, *TM, Object);
+    }
+
+    // Objects only touch the disk to reach the output or the linker.
+    SmallString<128> Path;
+    if (CompileOnly && !OutputFilename.empty()) {
+      Path = OutputFilename;
+    } else if (CompileOnly) {
+      Path = sys::path::filename(Src);
+      sys::path::replace_extension(Path, "o");
+    } else {
+      ExitOnErr(errorCodeToError(
+          sys::fs::createTemporaryFile("obf-cc", "o", Path)));
+    }
+    writeFile(Path, Object);
+    Objects.push_back(std::string(Path));
+  }
+
+  if (!CompileOnly) {
+    {
+      StageTimer T(Times.Link);
+      link(Objects, OutputFilename.empty() ? StringRef("a.out")
+                                           : StringRef(OutputFilename));
+    }
+    for (const std::string &Obj : Objects)
+      sys::fs::remove(Obj);
+  }
+  if (Remarks)
+    Remarks->keep();
+  reportStages(Times);
+  return 0;
+}
@@ -1,332 +1,1909 @@
 #include "ObfuscationPass.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/TargetParser/Triple.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Type.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Support/Timer.h"
+#include <array>
+#include <optional>
 #include <random>
 #include "llvm/Passes/PassBuilder.h"
 #include "llvm/Passes/PassPlugin.h"
 
 using namespace llvm;
 
-namespace {
-class ObfuscationLegacyPass : public ModulePass {
-public:
-  static char ID;
-  obf::ObfuscationOptions Options;
-  unsigned stats_bogus_blocks = 0;
-  unsigned stats_strings_obf = 0;
-  unsigned stats_nops = 0;
-  unsigned stats_fake_loops = 0;
+#define DEBUG_TYPE "obfuscation"
 
-  ObfuscationLegacyPass() : ModulePass(ID) {}
+STATISTIC(NumFunctions, "Number of functions obfuscated");
+STATISTIC(NumBogusBlocks, "Number of bogus blocks inserted");
+STATISTIC(NumNops, "Number of NOP instructions inserted");
+STATISTIC(NumFakeLoops, "Number of fake loops inserted");
+STATISTIC(NumInstsAdded, "Number of IR instructions added");
+STATISTIC(NumBlocksAdded, "Number of basic blocks added");
+STATISTIC(NumStringsEncrypted, "Number of strings encrypted");
+STATISTIC(NumStringBytes, "Number of string bytes encrypted");
+STATISTIC(NumLazyStrings, "Number of strings decrypted on first use");
+STATISTIC(NumStackStrings, "Number of strings decrypted on the stack");
+STATISTIC(NumDirtyPages, "Number of pages startup string decryption dirties");
+STATISTIC(NumCacheHits, "Number of functions restored from the cache");
+STATISTIC(NumCacheMisses, "Number of functions obfuscated and cached");
+STATISTIC(NumGrowthCapped, "Number of functions that reached the growth cap");
+STATISTIC(NumBudgetExhausted,
+          "Number of functions that used up their cost budget");
 
-  bool runOnModule(Module &M) override {
-    // Read options from module metadata (simple approach)
-    parseOptionsFromModule(M);
-
-    for (Function &F : M) {
-      if (F.isDeclaration()) continue;
-      if (F.getName().starts_with("llvm.")) continue;
-      runOnFunction(F);
+Expected<obf::ObfuscationOptions> obf::parseObfuscationOptions(StringRef Params) {
+  ObfuscationOptions Opts;
+  while (!Params.empty()) {
+    StringRef Param;
+    std::tie(Param, Params) = Params.split(';');
+    if (Param == "flatten" || Param == "no-flatten") {
+      Opts.enableFlatten = Param == "flatten";
+      continue;
+    }
+    if (Param == "selected-only") {
+      Opts.selectedOnly = true;
+      continue;
+    }
+    if (Param == "bogus-loops") {
+      Opts.bogusInLoops = true;
+      continue;
+    }
+    if (Param == "cold-bogus") {
+      Opts.outlineBogus = true;
+      continue;
+    }
+    if (Param == "lazy-strings") {
+      Opts.lazyStrings = true;
+      continue;
+    }
+    if (Param == "stack-strings") {
+      Opts.stackStrings = true;
+      continue;
+    }
+    if (Param == "cow-strings") {
+      Opts.cowStrings = true;
+      continue;
+    }
+    StringRef Key, Value;
+    std::tie(Key, Value) = Param.split('=');
+    if (Key == "cache") {
+      Opts.cacheDir = Value.str();
+      continue;
+    }
+    if (Key == "profile") {
+      Expected<bool> IsSample = isSampleProfile(Value);
+      if (!IsSample)
+        return IsSample.takeError();
+      Opts.profileFile = Value.str();
+      Opts.profileIsSample = *IsSample;
+      continue;
+    }
+    if (Key == "policy") {
+      Opts.policyFile = Value.str();
+      Expected<std::shared_ptr<const ObfuscationPolicy>> Policy =
+          loadObfuscationPolicy(Value);
+      if (!Policy)
+        return Policy.takeError();
+      Opts.policy = std::move(*Policy);
+      continue;
     }
+    if (Key == "seed") {
+      if (Value.getAsInteger(0, Opts.seed))
+        return make_error<StringError>(
+            formatv("invalid obf pass parameter '{0}'", Param).str(),
+            inconvertibleErrorCode());
+      continue;
+    }
+    unsigned N;
+    if (Value.getAsInteger(0, N))
+      return make_error<StringError>(
+          formatv("invalid obf pass parameter '{0}'", Param).str(),
+          inconvertibleErrorCode());
+    if (Key == "bogus")
+      Opts.bogusBlocksPerFunction = N;
+    else if (Key == "nops")
+      Opts.insertNops = N;
+    else if (Key == "strings")
+      Opts.stringEncryptLevel = N;
+    else if (Key == "parts")
+      Opts.partitions = N;
+    else if (Key == "threads")
+      Opts.threads = N;
+    else if (Key == "max-growth")
+      Opts.maxGrowth = N;
+    else if (Key == "hot")
+      Opts.hotRatio = N;
+    else if (Key == "budget")
+      Opts.costBudget = N;
+    else
+      return make_error<StringError>(
+          formatv("unknown obf pass parameter '{0}'", Key).str(),
+          inconvertibleErrorCode());
+  }
+  return Opts;
+}
+
+static unsigned getUnsignedFnAttr(const Function &F, StringRef Kind,
+                                  unsigned Default) {
+  Attribute A = F.getFnAttribute(Kind);
+  unsigned N;
+  if (!A.isStringAttribute() || A.getValueAsString().getAsInteger(0, N))
+    return Default;
+  return N;
+}
+
+obf::ObfuscationOptions
+obf::getFunctionOptions(const Function &F, const ObfuscationOptions &Defaults) {
+  ObfuscationOptions Opts = Defaults;
+  Opts.bogusBlocksPerFunction =
+      getUnsignedFnAttr(F, "obf-bogus", Opts.bogusBlocksPerFunction);
+  Opts.insertNops = getUnsignedFnAttr(F, "obf-nops", Opts.insertNops);
+  Opts.stringEncryptLevel =
+      getUnsignedFnAttr(F, "obf-strings", Opts.stringEncryptLevel);
+  Attribute Flatten = F.getFnAttribute("obf-flatten");
+  if (Flatten.isStringAttribute())
+    Opts.enableFlatten = Flatten.getValueAsString() == "true";
+  return Opts;
+}
+
+bool obf::isObfuscationDisabled(const Function &F) {
+  return F.hasFnAttribute("no-obf");
+}
+
+std::mt19937_64 obf::makeRNG(uint64_t Seed, StringRef Name, uint64_t Salt) {
+  MD5 Hasher;
+  Hasher.update(Name);
+  uint8_t Buf[16];
+  support::endian::write64le(Buf, Seed);
+  support::endian::write64le(Buf + 8, Salt);
+  Hasher.update(Buf);
+  MD5::MD5Result Hash;
+  Hasher.final(Hash);
+  return std::mt19937_64(Hash.low() ^ Hash.high());
+}
+
+// Branch weights for a conditional branch whose true edge is never taken.
+static MDNode *neverTakenWeights(LLVMContext &C) {
+  return MDBuilder(C).createBranchWeights(1, (1u << 20) - 1);
+}
+
+static MDNode *obfTag(LLVMContext &C, StringRef Kind) {
+  return MDNode::get(C, MDString::get(C, Kind));
+}
+
+void obf::tagObfuscation(Instruction &I, StringRef Kind) {
+  I.setMetadata("obf", obfTag(I.getContext(), Kind));
+}
 
-    runStringObfuscation(M);
+void obf::tagObfuscation(GlobalObject &GO, StringRef Kind) {
+  GO.setMetadata("obf", obfTag(GO.getContext(), Kind));
+}
 
-    // Print summary to stderr so driver can capture
-    errs() << "ObfuscationPass: bogus_blocks=" << stats_bogus_blocks
-           << " strings=" << stats_strings_obf
-           << " nops=" << stats_nops
-           << " fake_loops=" << stats_fake_loops << "\n";
+bool obf::isObfuscation(const Instruction &I) {
+  return I.hasMetadata("obf");
+}
+
+bool obf::isObfuscation(const GlobalObject &GO) {
+  return GO.hasMetadata("obf");
+}
+
+// F's size before its first cycle, recorded on F as !obf.size !{i32 N}.
+static unsigned getOriginalSize(Function &F) {
+  if (MDNode *N = F.getMetadata("obf.size"))
+    if (N->getNumOperands() == 1)
+      if (auto *CI = mdconst::dyn_extract<ConstantInt>(N->getOperand(0)))
+        return (unsigned)CI->getZExtValue();
+  unsigned Size = F.getInstructionCount();
+  LLVMContext &C = F.getContext();
+  F.setMetadata("obf.size",
+                MDNode::get(C, ConstantAsMetadata::get(
+                                   ConstantInt::get(Type::getInt32Ty(C), Size))));
+  return Size;
+}
+
+namespace {
+// Times one transform: a -time-trace event with Detail (usually the function
+// name) and, under -time-passes, a timer in the "Obfuscation transforms"
+// group. Timers are shared objects, so partition workers pass Timers=false.
+class TransformTimer {
+  TimeTraceScope Trace;
+  NamedRegionTimer Timer;
 
+public:
+  TransformTimer(StringRef Name, StringRef Desc, StringRef Detail,
+                 bool Timers = true)
+      : Trace(Desc, Detail),
+        Timer(Name, Desc, "obf", "Obfuscation transforms",
+              Timers && TimePassesIsEnabled) {}
+};
+
+// Applies the per-function transforms to one function. DT, LI, BFI and TTI
+// may be null when no bogus blocks are asked for.
+class FunctionObfuscator {
+  Function &F;
+  obf::ObfuscationStats &Stats;
+  DominatorTree *DT;
+  LoopInfo *LI;
+  BlockFrequencyInfo *BFI;
+  const TargetTransformInfo *TTI;
+  DomTreeUpdater DTU;
+  bool Timers;
+  // Instructions F may still grow by before reaching the growth cap.
+  unsigned Budget = ~0u;
+  // Salted with F's current size, so every cycle draws differently.
+  std::mt19937_64 RNG;
+  uint64_t Seed;
+  // Blocks the transforms keep out of (see findHotBlocks).
+  const obf::HotBlockSet &Hot;
+  // The run-time cost budget, if there is one.
+  obf::CostBudget *Costs;
+
+  // Takes N instructions from the growth budget and Cost, run in BB, from
+  // the cost budget; false (and the function is marked capped or out of
+  // budget) once either no longer fits.
+  bool spend(unsigned N, const BasicBlock &BB, uint64_t Cost) {
+    if (N > Budget) {
+      Stats.growthCapped = true;
+      return false;
+    }
+    if (Costs && !Costs->spend(BB, Cost)) {
+      Stats.budgetExhausted = true;
+      return false;
+    }
+    Budget -= N;
     return true;
   }
 
-  void parseOptionsFromModule(Module &M) {
-    // Very small: If module contains a global named "obf.options" interpreted as int fields
-    if (GlobalVariable *gv = M.getGlobalVariable("obf_bogus_blocks")) {
-      if (ConstantInt *CI = dyn_cast<ConstantInt>(gv->getInitializer())) {
-        Options.bogusBlocksPerFunction = (unsigned)CI->getZExtValue();
-      }
+public:
+  FunctionObfuscator(Function &F, obf::ObfuscationStats &Stats,
+                     DominatorTree *DT, LoopInfo *LI, BlockFrequencyInfo *BFI,
+                     const TargetTransformInfo *TTI, bool Timers,
+                     uint64_t Seed, const obf::HotBlockSet &Hot,
+                     obf::CostBudget *Costs)
+      : F(F), Stats(Stats), DT(DT), LI(LI), BFI(BFI), TTI(TTI),
+        DTU(DT, DomTreeUpdater::UpdateStrategy::Eager), Timers(Timers),
+        RNG(obf::makeRNG(Seed, F.getName(), F.getInstructionCount())),
+        Seed(Seed), Hot(Hot), Costs(Costs) {}
+
+  // Each call adds at most the configured number of bogus blocks, NOPs and
+  // one fake loop, all placed in code earlier cycles did not insert, so N
+  // cycles cost N times one cycle until the growth cap or the cost budget
+  // stops them.
+  PreservedAnalyses run(const obf::ObfuscationOptions &FnOpts) {
+    TimeTraceScope FnScope("ObfuscateFunction", F.getName());
+    bool Changed = false, CFGChanged = false;
+    unsigned Original = getOriginalSize(F);
+    if (FnOpts.maxGrowth) {
+      uint64_t Limit = Original + (uint64_t)Original * FnOpts.maxGrowth / 100;
+      unsigned Size = F.getInstructionCount();
+      Budget = Size < Limit ? (unsigned)(Limit - Size) : 0;
     }
-    if (GlobalVariable *gv = M.getGlobalVariable("obf_string_level")) {
-      if (ConstantInt *CI = dyn_cast<ConstantInt>(gv->getInitializer())) {
-        Options.stringEncryptLevel = (unsigned)CI->getZExtValue();
+    // Insert bogus blocks
+    if (FnOpts.bogusBlocksPerFunction) {
+      TransformTimer T("bogus", "BogusBlocks", F.getName(), Timers);
+      // At most one per block, coldest blocks first.
+      unsigned Inserted = 0;
+      for (Instruction *Site :
+           obf::findColdSites(F, Hot, LI, *BFI, FnOpts.bogusInLoops)) {
+        if (Inserted == FnOpts.bogusBlocksPerFunction)
+          break;
+        if (insertBogusBlock(Site, FnOpts.outlineBogus)) {
+          ++Inserted;
+          CFGChanged = true;
+        }
       }
     }
-    if (GlobalVariable *gv = M.getGlobalVariable("obf_insert_nops")) {
-      if (ConstantInt *CI = dyn_cast<ConstantInt>(gv->getInitializer())) {
-        Options.insertNops = (unsigned)CI->getZExtValue();
-      }
+    // Insert cheap NOPs (fake instructions)
+    if (FnOpts.insertNops) {
+      TransformTimer T("nops", "NopInsertion", F.getName(), Timers);
+      Changed |= insertNopSequences(FnOpts.insertNops);
     }
-    if (GlobalVariable *gv = M.getGlobalVariable("obf_flatten")) {
-      if (ConstantInt *CI = dyn_cast<ConstantInt>(gv->getInitializer())) {
-        Options.enableFlatten = CI->isOne();
+    // The fake loop wraps the entry block, so it runs on every call.
+    if (FnOpts.enableFlatten && !Hot.count(&F.getEntryBlock()) &&
+        !hasObfuscationOnlyEntry() &&
+        spend(FakeLoopSize, F.getEntryBlock(),
+              Costs ? Costs->fakeLoopCost() : 0)) {
+      TransformTimer T("fake-loop", "FakeLoop", F.getName(), Timers);
+      // Lightweight fake loop as a minimal flattening surrogate
+      if (insertFakeLoopOnce()) {
+        ++Stats.fakeLoops;
+        ++NumFakeLoops;
+        CFGChanged = true;
       }
     }
-  }
 
-  void runOnFunction(Function &F) {
-    // Insert bogus blocks
-    for (unsigned i = 0; i < Options.bogusBlocksPerFunction; ++i)
-      insertBogusBlock(F);
-    // Insert cheap NOPs (fake instructions)
-    if (Options.insertNops) insertNopSequences(F, Options.insertNops);
-    if (Options.enableFlatten) {
-      // Lightweight fake loop as a minimal flattening surrogate
-      // Note: kept conservative to avoid IR verifier issues across LLVM 20
-      insertFakeLoopOnce(F);
-      ++stats_fake_loops;
+    if (!Changed && !CFGChanged)
+      return PreservedAnalyses::all();
+    PreservedAnalyses PA;
+    if (!CFGChanged) {
+      PA.preserveSet<CFGAnalyses>();
+      return PA;
     }
+    if (DT && LI) {
+      PA.preserve<DominatorTreeAnalysis>();
+      PA.preserve<LoopAnalysis>();
+    }
+    return PA;
+  }
+
+  // Upper bounds on what one bogus block and one fake loop add.
+  static constexpr unsigned BogusBlockSize = 16;
+  static constexpr unsigned FakeLoopSize = 5;
+
+  // How often BB runs per call, by BFI's estimate.
+  double weightOf(const BasicBlock &BB) const {
+    uint64_t Entry = std::max<uint64_t>(
+        BFI->getBlockFreq(&F.getEntryBlock()).getFrequency(), 1);
+    return (double)BFI->getBlockFreq(&BB).getFrequency() / Entry;
   }
 
-  void insertBogusBlock(Function &F) {
-    // Find a basic block to split (choose entry->first)
-    BasicBlock &BB = F.getEntryBlock();
-    Instruction *first = BB.getFirstNonPHI();
-    if (!first) return;
+  // An integer of at least 8 bits for a predicate to build on: preferably
+  // an argument, which is invariant in every loop, else a value computed
+  // earlier in the block of Before.
+  Value *findLiveInteger(Instruction *Before) {
+    auto Usable = [](const Value &V) {
+      auto *Ty = dyn_cast<IntegerType>(V.getType());
+      return Ty && Ty->getBitWidth() >= 8;
+    };
+    SmallVector<Value *, 8> Candidates;
+    for (Argument &A : F.args())
+      if (Usable(A))
+        Candidates.push_back(&A);
+    if (Candidates.empty())
+      for (Instruction &I : *Before->getParent()) {
+        if (&I == Before)
+          break;
+        if (Usable(I) && !obf::isObfuscation(I))
+          Candidates.push_back(&I);
+      }
+    if (Candidates.empty())
+      return nullptr;
+    return Candidates[RNG() % Candidates.size()];
+  }
 
+  // Splits the block of `first` in front of it, behind a predicate that
+  // never holds; with Outline the filler goes to a cold function. The
+  // predicate's tier follows how often the block runs, and in a loop it is
+  // computed once in the preheader when its input allows.
+  bool insertBogusBlock(Instruction *first, bool Outline) {
+    BasicBlock &BB = *first->getParent();
     LLVMContext &C = F.getContext();
-    IRBuilder<> B(first);
 
-    // Create opaque predicate using current time (not constant-foldable) or use llvm.cpu.feature? For simplicity, use rand via global.
-    // We'll create: if ( (ptrtoint (fnptr) & 0xFF) == 0xAB ) goto bogus else continue
-    Constant *fnPtr = ConstantExpr::getBitCast(&F, Type::getInt8Ty(C)->getPointerTo());
-    Value *intVal = B.CreatePtrToInt(fnPtr, Type::getInt64Ty(C));
-    Value *masked = B.CreateAnd(intVal, ConstantInt::get(Type::getInt64Ty(C), 0xFF));
-    Value *cmp = B.CreateICmpEQ(masked, ConstantInt::get(Type::getInt64Ty(C), 0xAB));
+    Value *Live = findLiveInteger(first);
+    Instruction *PredPos = first;
+    if (Loop *L = LI ? LI->getLoopFor(&BB) : nullptr)
+      if (BasicBlock *Preheader = L->getLoopPreheader())
+        if (!Live || L->isLoopInvariant(Live))
+          PredPos = Preheader->getTerminator();
+    IRBuilder<> B(PredPos);
+    obf::OpaquePredicate P = obf::createOpaquePredicate(
+        B, obf::choosePredicateTier(weightOf(BB)), Live, Seed, RNG);
+    uint64_t Latency = 0;
+    for (Instruction *I : P.Insts)
+      Latency += obf::getLatency(*TTI, *I);
+    // Only the predicate and its branch run; the bogus block never does.
+    if (!spend(BogusBlockSize, BB, Latency + obf::getBranchLatency(*TTI))) {
+      for (Instruction *I : reverse(P.Insts))
+        I->eraseFromParent();
+      return false;
+    }
+    Value *cmp = P.Cond;
 
-    BasicBlock *cont = BB.splitBasicBlock(first, F.getName() + "_cont");
+    BasicBlock *cont = SplitBlock(&BB, first, &DTU, LI, nullptr, F.getName() + "_cont");
+    if (Costs)
+      Costs->inherit(*cont, BB);
     BasicBlock *bogus = BasicBlock::Create(C, F.getName() + "_bogus", &F, cont);
 
     // Replace the unconditional branch at end of BB (split) with conditional branch
-    // Remove the original terminator from BB (it was moved to cont), and create conditional branch
     BB.getTerminator()->eraseFromParent();
+    // The weights keep block placement from laying the bogus block out in
+    // the fall-through path.
     IRBuilder<> B2(&BB);
-    B2.CreateCondBr(cmp, bogus, cont);
+    BranchInst *Br = B2.CreateCondBr(cmp, bogus, cont, neverTakenWeights(C));
+    obf::tagObfuscation(*Br, "bogus");
+    // !obf.pred !{!"<tier>", i32 <latency>}
+    Br->setMetadata(
+        "obf.pred",
+        MDNode::get(C, {MDString::get(C, obf::getPredicateTierName(P.Tier)),
+                        ConstantAsMetadata::get(ConstantInt::get(
+                            Type::getInt32Ty(C), Latency))}));
 
     // Fill bogus with weird instructions and return or jump to cont
     IRBuilder<> Bb(bogus);
     // produce some unreachable-looking operations
-    Function *printfFn = nullptr;
-    // simple arithmetic
-    Value *a = Bb.CreateAlloca(Type::getInt32Ty(C));
-    Bb.CreateStore(ConstantInt::get(Type::getInt32Ty(C), 0xDEADBEEF), a);
+    // simple arithmetic, on a slot in the entry block so it stays a static
+    // alloca (an outlined body takes it along into the cold function's)
+    IRBuilder<> Entry(&F.getEntryBlock(),
+                      F.getEntryBlock().getFirstInsertionPt());
+    AllocaInst *a = (Outline ? Bb : Entry).CreateAlloca(Type::getInt32Ty(C));
+    obf::tagObfuscation(*a, "bogus");
+    Bb.CreateStore(ConstantInt::get(Type::getInt32Ty(C), (uint32_t)RNG()), a);
     Value *ld = Bb.CreateLoad(Type::getInt32Ty(C), a);
-    Value *xorv = Bb.CreateXor(ld, ConstantInt::get(Type::getInt32Ty(C), 0xFEED));
+    Value *xorv = Bb.CreateXor(ld, ConstantInt::get(Type::getInt32Ty(C), (uint32_t)RNG()));
     Bb.CreateStore(xorv, a);
     // branch to cont
     Bb.CreateBr(cont);
+    if (Outline)
+      outlineBogusBody(*bogus);
+    for (Instruction &I : *bogus)
+      obf::tagObfuscation(I, "bogus");
+
+    // Keep the analyses in sync: BB -> bogus -> cont is a new path.
+    if (LI)
+      if (Loop *L = LI->getLoopFor(&BB))
+        L->addBasicBlockToLoop(bogus, *LI);
+    DTU.applyUpdates({{DominatorTree::Insert, &BB, bogus},
+                      {DominatorTree::Insert, bogus, cont}});
 
-    ++stats_bogus_blocks;
+    ++Stats.bogusBlocks;
+    ++NumBogusBlocks;
+    switch (P.Tier) {
+    case obf::PredicateTier::Alu:
+      ++Stats.aluPredicates;
+      break;
+    case obf::PredicateTier::Algebraic:
+      ++Stats.algebraicPredicates;
+      break;
+    case obf::PredicateTier::GlobalState:
+      ++Stats.statePredicates;
+      break;
+    }
+    Stats.predicateLatency += Latency;
+    return true;
   }
 
-  void insertNopSequences(Function &F, unsigned count) {
+  // Moves the filler of a bogus block into a cold, never inlined function
+  // in .text.unlikely and calls that instead, so F's own code keeps only
+  // the predicate and a call. Per-block sections do not exist in IR, so
+  // this is how the filler leaves F's section.
+  void outlineBogusBody(BasicBlock &Bogus) {
     LLVMContext &C = F.getContext();
-    for (BasicBlock &BB : F) {
-      for (Instruction &I : BB) {
-        // Insert after instruction
-        if (count == 0) break;
-        IRBuilder<> B(&I);
-        // create a faux operation: tmp = add i32 0, 0
-        Value *tmp = B.CreateAdd(ConstantInt::get(Type::getInt32Ty(C), 0),
-                                 ConstantInt::get(Type::getInt32Ty(C), 0));
-        (void)tmp; // unused
-        stats_nops++;
-        --count;
-      }
+    Function *Cold = Function::Create(
+        FunctionType::get(Type::getVoidTy(C), false),
+        GlobalValue::InternalLinkage, F.getName() + ".obf.cold",
+        F.getParent());
+    Cold->addFnAttr(Attribute::Cold);
+    Cold->addFnAttr(Attribute::NoInline);
+    Cold->addFnAttr(Attribute::MinSize);
+    Cold->addFnAttr(Attribute::OptimizeForSize);
+    Cold->addFnAttr(Attribute::NoUnwind);
+    Cold->setSectionPrefix("unlikely");
+    obf::tagObfuscation(*Cold, "bogus");
+    ReturnInst *Ret = ReturnInst::Create(C, BasicBlock::Create(C, "entry", Cold));
+    while (&Bogus.front() != Bogus.getTerminator())
+      Bogus.front().moveBefore(Ret);
+    for (Instruction &I : Cold->getEntryBlock())
+      obf::tagObfuscation(I, "bogus");
+    CallInst *Call = CallInst::Create(Cold, "", Bogus.getTerminator());
+    Call->addFnAttr(Attribute::Cold);
+  }
+
+  bool insertNopSequences(unsigned count) {
+    LLVMContext &C = F.getContext();
+    // Pad in front of original instructions only, never in front of PHIs,
+    // EH pads, earlier padding or the ret a musttail call must precede, nor
+    // in hot blocks; the sites are a uniform sample of those.
+    SmallVector<Instruction *, 16> Sites;
+    uint64_t Seen = 0;
+    for (Instruction &I : instructions(F)) {
+      if (Hot.count(I.getParent()) || isa<PHINode>(I) || I.isEHPad() ||
+          obf::isObfuscation(I) ||
+          (I.isTerminator() && I.getParent()->getTerminatingMustTailCall()))
+        continue;
+      if (Sites.size() < count)
+        Sites.push_back(&I);
+      else if (uint64_t J = RNG() % (Seen + 1); J < count)
+        Sites[J] = &I;
+      ++Seen;
+    }
+    unsigned Added = 0;
+    uint64_t Cost = Costs ? Costs->nopCost() : 0;
+    for (Instruction *I : Sites) {
+      // A colder site may still fit when this one does not.
+      if (!spend(1, *I->getParent(), Cost)) continue;
+      // create a faux operation: tmp = add i32 0, 0 (not through IRBuilder,
+      // which would fold it away)
+      Constant *Zero = ConstantInt::get(Type::getInt32Ty(C), 0);
+      Instruction *Nop = BinaryOperator::CreateAdd(Zero, Zero, "obf.nop", I);
+      obf::tagObfuscation(*Nop, "nop");
+      Stats.nops++;
+      ++NumNops;
+      ++Added;
     }
+    return Added != 0;
   }
 
-  // Wrap entry block instructions into a loop that executes exactly once
-  // to introduce additional control flow without altering semantics.
-  void insertFakeLoopOnce(Function &F) {
-    if (F.isDeclaration()) return;
-    BasicBlock &entry = F.getEntryBlock();
-    Instruction *first = entry.getFirstNonPHI();
-    if (!first) return;
+  // Whether the entry block holds nothing but static allocas, our own code
+  // and the branch into an earlier cycle's fake loop: wrapping it again
+  // would only loop around that branch.
+  bool hasObfuscationOnlyEntry() const {
+    BasicBlock &Entry = F.getEntryBlock();
+    MDNode *Tag = Entry.getTerminator()->getMetadata("obf");
+    if (!Tag || cast<MDString>(Tag->getOperand(0))->getString() != "fake-loop")
+      return false;
+    for (Instruction &I : Entry) {
+      auto *AI = dyn_cast<AllocaInst>(&I);
+      if (!(AI && AI->isStaticAlloca()) && !obf::isObfuscation(I))
+        return false;
+    }
+    return true;
+  }
 
+  // Turns the body of the entry block into a do-while loop whose back edge
+  // is never taken:
+  //
+  //   entry:    allocas; br %loop
+  //   loop:     %iv = phi [0, %entry], [%iv.next, %loop]
+  //             ...the rest of the entry block...
+  //             %iv.next = add %iv, 1
+  //             br (%iv.next < 1), %loop, %tail     ; weighted never-taken
+  //   tail:     the entry block's terminator
+  //
+  // Everything defined in the loop dominates the tail, so no value needs a
+  // PHI, and the run-time cost is one add, one compare and two branches.
+  // Static allocas stay in the entry block; a musttail call stays with its
+  // ret. Entry blocks holding token values or llvm.localescape are left
+  // alone, since those may not move.
+  bool insertFakeLoopOnce() {
+    BasicBlock &Entry = F.getEntryBlock();
     LLVMContext &C = F.getContext();
-    IRBuilder<> B(&entry);
-
-    // Create blocks: pre (existing entry up to branch), loop, body, exit
-    BasicBlock *loopHdr = BasicBlock::Create(C, F.getName() + ".obf.loop", &F);
-    BasicBlock *body = BasicBlock::Create(C, F.getName() + ".obf.body", &F);
-    BasicBlock *exitB = BasicBlock::Create(C, F.getName() + ".obf.exit", &F);
-
-    // Split entry so that 'first' becomes start of continuation
-    BasicBlock *cont = entry.splitBasicBlock(first, F.getName() + ".obf.cont");
-
-    // Rebuild terminator of original 'entry' to branch to loop header
-    entry.getTerminator()->eraseFromParent();
-    IRBuilder<> Be(&entry);
-    Be.CreateBr(loopHdr);
-
-    // Loop header with a predicate that is true exactly once
-    IRBuilder<> Bh(loopHdr);
-    // Create an induction variable in an alloca to avoid SSA PHIs for simplicity
-    AllocaInst *iv = new AllocaInst(Type::getInt32Ty(C), 0, "obf_iv", &*cont->getFirstInsertionPt());
-    Bh.CreateStore(ConstantInt::get(Type::getInt32Ty(C), 0), iv);
-    Value *ivLoad = Bh.CreateLoad(Type::getInt32Ty(C), iv);
-    Value *cond = Bh.CreateICmpEQ(ivLoad, ConstantInt::get(Type::getInt32Ty(C), 0));
-    Bh.CreateCondBr(cond, body, exitB);
-
-    // Move original 'cont' block instructions into 'body' safely
-    IRBuilder<> Bb(body);
-    while (!cont->empty()) {
-      Instruction &I = cont->front();
-      if (Instruction *Term = body->getTerminator()) {
-        I.moveBefore(Term);
-      } else {
-        I.moveBefore(*body, body->end());
+    Type *I32 = Type::getInt32Ty(C);
+
+    Instruction *End = Entry.getTerminator();
+    if (CallInst *MustTail = Entry.getTerminatingMustTailCall())
+      End = MustTail;
+    // Gather static allocas in front of the first instruction that moves.
+    Instruction *First = nullptr;
+    for (Instruction &I : make_early_inc_range(Entry)) {
+      if (&I == End)
+        break;
+      auto *AI = dyn_cast<AllocaInst>(&I);
+      if (AI && AI->isStaticAlloca()) {
+        if (First)
+          AI->moveBefore(First);
+        continue;
       }
+      if (I.getType()->isTokenTy())
+        return false;
+      if (auto *II = dyn_cast<IntrinsicInst>(&I))
+        if (II->getIntrinsicID() == Intrinsic::localescape)
+          return false;
+      if (!First)
+        First = &I;
     }
-    // At end of body, set iv=1 and jump back to header
-    IRBuilder<> Bend(&body->back());
-    // Ensure last instruction is a terminator; if not, append before terminator creation
-    if (!body->getTerminator()) {
-      Bend.SetInsertPoint(body);
-    } else {
-      Bend.SetInsertPoint(body->getTerminator());
+    if (!First)
+      First = End;
+
+    BasicBlock *Loop =
+        SplitBlock(&Entry, First, &DTU, LI, nullptr, F.getName() + ".obf.loop");
+    BasicBlock *Tail =
+        SplitBlock(Loop, End, &DTU, LI, nullptr, F.getName() + ".obf.tail");
+    obf::tagObfuscation(*Entry.getTerminator(), "fake-loop");
+
+    IRBuilder<> B(&Loop->front());
+    PHINode *IV = B.CreatePHI(I32, 2, "obf.iv");
+    B.SetInsertPoint(Loop->getTerminator());
+    Value *Next = B.CreateAdd(IV, ConstantInt::get(I32, 1), "obf.iv.next");
+    Value *Again = B.CreateICmpSLT(Next, ConstantInt::get(I32, 1));
+    BranchInst *Latch = B.CreateCondBr(
+        Again, Loop, Tail, neverTakenWeights(C));
+    Loop->getTerminator()->eraseFromParent();
+    IV->addIncoming(ConstantInt::get(I32, 0), &Entry);
+    IV->addIncoming(Next, Loop);
+    for (Value *V : {(Value *)IV, Next, Again, (Value *)Latch})
+      obf::tagObfuscation(*cast<Instruction>(V), "fake-loop");
+
+    // A self-loop changes no dominance; LoopInfo gets the new loop.
+    if (LI) {
+      llvm::Loop *L = LI->AllocateLoop();
+      LI->addTopLevelLoop(L);
+      L->addBasicBlockToLoop(Loop, *LI);
     }
-    Bend.CreateStore(ConstantInt::get(Type::getInt32Ty(C), 1), iv);
-    Bend.CreateBr(loopHdr);
+    return true;
+  }
+};
 
-    // Exit block branches to the (now empty) cont block successor (which was moved)
-    IRBuilder<> BeX(exitB);
-    BeX.CreateBr(cont);
+// Reads options from the obf_* globals linked in by the original
+// obf_options.ll protocol, keeping Opts for any that are missing.
+void parseOptionsFromModule(Module &M, obf::ObfuscationOptions &Options) {
+  // Very small: If module contains a global named "obf.options" interpreted as int fields
+  if (GlobalVariable *gv = M.getGlobalVariable("obf_bogus_blocks")) {
+    if (ConstantInt *CI = dyn_cast<ConstantInt>(gv->getInitializer())) {
+      Options.bogusBlocksPerFunction = (unsigned)CI->getZExtValue();
+    }
+  }
+  if (GlobalVariable *gv = M.getGlobalVariable("obf_string_level")) {
+    if (ConstantInt *CI = dyn_cast<ConstantInt>(gv->getInitializer())) {
+      Options.stringEncryptLevel = (unsigned)CI->getZExtValue();
+    }
+  }
+  if (GlobalVariable *gv = M.getGlobalVariable("obf_insert_nops")) {
+    if (ConstantInt *CI = dyn_cast<ConstantInt>(gv->getInitializer())) {
+      Options.insertNops = (unsigned)CI->getZExtValue();
+    }
+  }
+  if (GlobalVariable *gv = M.getGlobalVariable("obf_flatten")) {
+    if (ConstantInt *CI = dyn_cast<ConstantInt>(gv->getInitializer())) {
+      Options.enableFlatten = CI->isOne();
+    }
   }
+}
 
-  void runStringObfuscation(Module &M) {
-    LLVMContext &C = M.getContext();
-    std::vector<GlobalVariable*> toReplace;
-    for (GlobalVariable &GV : M.globals()) {
-      if (!GV.hasInitializer()) continue;
-      if (GV.getValueType()->isArrayTy()) {
-        if (GV.getName().starts_with("str.")) {
-          toReplace.push_back(&GV);
-        }
+} // namespace
+
+// The level GV is encrypted at: the highest one among the functions using
+// it, or the module's for uses outside functions (and for a lazily loaded
+// module, whose uses are not read yet); 0 leaves it in plaintext.
+static unsigned getStringLevel(const GlobalVariable &GV,
+                               const obf::ObfuscationOptions &Opts) {
+  if (GV.use_empty())
+    return Opts.stringEncryptLevel;
+  unsigned Level = 0;
+  SmallVector<const User *, 8> Worklist(GV.users());
+  while (!Worklist.empty()) {
+    const User *U = Worklist.pop_back_val();
+    if (isa<ConstantExpr>(U)) {
+      Worklist.append(U->user_begin(), U->user_end());
+      continue;
+    }
+    auto *I = dyn_cast<Instruction>(U);
+    if (!I) {
+      Level = std::max(Level, Opts.stringEncryptLevel);
+      continue;
+    }
+    const Function &F = *I->getFunction();
+    if (!obf::isObfuscationDisabled(F))
+      Level = std::max(Level,
+                       obf::getFunctionOptions(F, Opts).stringEncryptLevel);
+  }
+  return Level;
+}
+
+// Emits a loop XOR-decrypting the Len bytes at Src into Dst (which may be
+// Src itself) at B, which is left at the block after it.
+static void emitDecryptLoop(IRBuilder<> &B, Value *Src, Value *Dst,
+                            unsigned Len, uint8_t Key) {
+  LLVMContext &C = B.getContext();
+  Function *F = B.GetInsertBlock()->getParent();
+  // i = 0
+  AllocaInst *idx = B.CreateAlloca(Type::getInt32Ty(C));
+  B.CreateStore(ConstantInt::get(Type::getInt32Ty(C), 0), idx);
+  BasicBlock *loop = BasicBlock::Create(C, "dec.loop", F);
+  BasicBlock *after = BasicBlock::Create(C, "dec.after", F);
+  B.CreateBr(loop);
+  IRBuilder<> lb(loop);
+  Value *iv = lb.CreateLoad(Type::getInt32Ty(C), idx);
+  Value *cond = lb.CreateICmpULT(iv, ConstantInt::get(Type::getInt32Ty(C), Len));
+  BasicBlock *body = BasicBlock::Create(C, "dec.body", F);
+  lb.CreateCondBr(cond, body, after);
+  IRBuilder<> bb(body);
+  // ch = Src[iv]
+  Value *iv64 = bb.CreateZExt(iv, Type::getInt64Ty(C));
+  Value *ch = bb.CreateLoad(Type::getInt8Ty(C),
+                            bb.CreateInBoundsGEP(Type::getInt8Ty(C), Src, iv64));
+  Value *k = ConstantInt::get(Type::getInt8Ty(C), Key);
+  // key + (i & 0xFF)
+  Value *ioff = bb.CreateTrunc(iv, Type::getInt8Ty(C));
+  Value *k2 = bb.CreateAdd(k, ioff);
+  Value *dec = bb.CreateXor(ch, k2);
+  bb.CreateStore(dec, bb.CreateInBoundsGEP(Type::getInt8Ty(C), Dst, iv64));
+  // i++
+  Value *inc = bb.CreateAdd(iv, ConstantInt::get(Type::getInt32Ty(C), 1));
+  bb.CreateStore(inc, idx);
+  bb.CreateBr(loop);
+  B.SetInsertPoint(after);
+}
+
+// Encrypts the Len bytes of s with Key for emitDecryptLoop, as a C string.
+static Constant *encryptString(LLVMContext &C, StringRef s, uint8_t key) {
+  std::string enc;
+  enc.reserve(s.size());
+  for (unsigned i = 0; i < s.size(); ++i) {
+    enc.push_back((char)(s[i] ^ (key + (i & 0xFF))));
+  }
+  return ConstantDataArray::getString(C, StringRef(enc), true);
+}
+
+// GV and the constant expressions built on it, if every use of those is
+// an instruction other than an EH pad (nothing can go in front of one);
+// empty otherwise.
+static SmallPtrSet<Constant *, 8> findInstructionOnlyUses(GlobalVariable &GV) {
+  SmallPtrSet<Constant *, 8> Reaching;
+  SmallVector<Constant *, 8> Worklist{&GV};
+  Reaching.insert(&GV);
+  while (!Worklist.empty()) {
+    Constant *C = Worklist.pop_back_val();
+    for (User *U : C->users()) {
+      if (auto *I = dyn_cast<Instruction>(U)) {
+        if (I->isEHPad())
+          return {};
+        continue;
       }
+      auto *CE = dyn_cast<ConstantExpr>(U);
+      if (!CE)
+        return {};
+      if (Reaching.insert(CE).second)
+        Worklist.push_back(CE);
     }
+  }
+  return Reaching;
+}
 
-    // Prepare an init function to decrypt strings at startup
-    Function *initF = nullptr;
-    IRBuilder<> *initBuilder = nullptr;
-
-    for (GlobalVariable *GV : toReplace) {
-      Constant *init = GV->getInitializer();
-      if (ConstantDataArray *CDA = dyn_cast<ConstantDataArray>(init)) {
-        if (!CDA->isCString()) continue;
-        StringRef s = CDA->getAsCString();
-        std::string enc;
-        enc.reserve(s.size());
-        uint8_t key = (uint8_t)(Options.stringEncryptLevel * 37 + 13);
-        for (unsigned i = 0; i < s.size(); ++i) {
-          enc.push_back((char)(s[i] ^ (key + (i & 0xFF))));
-        }
-        // Create new global with encrypted bytes
-        ArrayType *arrTy = ArrayType::get(IntegerType::get(C, 8), enc.size()+1);
-        Constant *newInit = ConstantDataArray::getString(C, StringRef(enc), true);
-        GlobalVariable *gEnc = new GlobalVariable(M, arrTy, /*isConstant*/false, GlobalValue::PrivateLinkage, newInit, GV->getName() + ".enc");
-        // Replace original GV with pointer to encrypted global
-        GV->replaceAllUsesWith(ConstantExpr::getBitCast(gEnc, GV->getType()));
-        stats_strings_obf++;
-
-        // Lazily create/init builder and function
-        if (!initF) {
-          FunctionType *FT = FunctionType::get(Type::getVoidTy(C), false);
-          initF = Function::Create(FT, GlobalValue::InternalLinkage, "__obf_init", M);
-          BasicBlock *ib = BasicBlock::Create(C, "entry", initF);
-          initBuilder = new IRBuilder<>(ib);
-        }
-        // Emit a simple loop to XOR-decrypt in-place at startup
-        // i = 0
-        AllocaInst *idx = initBuilder->CreateAlloca(Type::getInt32Ty(C));
-        initBuilder->CreateStore(ConstantInt::get(Type::getInt32Ty(C), 0), idx);
-        BasicBlock *loop = BasicBlock::Create(C, "dec.loop", initF);
-        BasicBlock *after = BasicBlock::Create(C, "dec.after", initF);
-        initBuilder->CreateBr(loop);
-        IRBuilder<> lb(loop);
-        Value *iv = lb.CreateLoad(Type::getInt32Ty(C), idx);
-        Value *cond = lb.CreateICmpULT(iv, ConstantInt::get(Type::getInt32Ty(C), (unsigned)s.size()));
-        BasicBlock *body = BasicBlock::Create(C, "dec.body", initF);
-        lb.CreateCondBr(cond, body, after);
-        IRBuilder<> bb(body);
-        // ptr = &gEnc[iv]
-        Value *zero = ConstantInt::get(Type::getInt32Ty(C), 0);
-        Value *iv64 = bb.CreateZExt(iv, Type::getInt64Ty(C));
-        Value *gep = bb.CreateInBoundsGEP(gEnc->getValueType(), gEnc, {zero, bb.CreateTruncOrBitCast(iv64, Type::getInt32Ty(C))});
-        Value *ch = bb.CreateLoad(Type::getInt8Ty(C), gep);
-        Value *k = ConstantInt::get(Type::getInt8Ty(C), key);
-        // key + (i & 0xFF)
-        Value *ioff = bb.CreateTrunc(iv, Type::getInt8Ty(C));
-        Value *k2 = bb.CreateAdd(k, ioff);
-        Value *dec = bb.CreateXor(ch, k2);
-        bb.CreateStore(dec, gep);
-        // i++
-        Value *inc = bb.CreateAdd(iv, ConstantInt::get(Type::getInt32Ty(C), 1));
-        bb.CreateStore(inc, idx);
-        bb.CreateBr(loop);
-        IRBuilder<> ab(after);
-        // continue; will be connected by next emission or finish below
+// Rebuilds constant C, which reaches GV, as instructions in front of
+// InsertPt with GV replaced by Ptr.
+static Value *rebuildWith(Constant *C, Value *Ptr,
+                          const SmallPtrSetImpl<Constant *> &Reaching,
+                          Instruction *InsertPt) {
+  auto *CE = dyn_cast<ConstantExpr>(C);
+  if (!CE)
+    return Ptr;
+  Instruction *I = CE->getAsInstruction(InsertPt);
+  for (Use &Op : I->operands())
+    if (auto *OpC = dyn_cast<Constant>(Op.get()); OpC && Reaching.count(OpC))
+      Op.set(rebuildWith(OpC, Ptr, Reaching, I));
+  return I;
+}
+
+// The uses of GV and of the constant expressions in Reaching by
+// instructions, in use-list order.
+static SmallVector<Use *, 8>
+collectInstructionUses(GlobalVariable &GV,
+                       const SmallPtrSetImpl<Constant *> &Reaching) {
+  SmallVector<Use *, 8> Uses;
+  SmallPtrSet<Constant *, 8> Visited{&GV};
+  SmallVector<Constant *, 8> Worklist{&GV};
+  while (!Worklist.empty())
+    for (Use &U : Worklist.pop_back_val()->uses()) {
+      if (isa<Instruction>(U.getUser()))
+        Uses.push_back(&U);
+      else if (auto *CE = dyn_cast<ConstantExpr>(U.getUser());
+               CE && Reaching.count(CE) && Visited.insert(CE).second)
+        Worklist.push_back(CE);
+    }
+  return Uses;
+}
+
+namespace {
+// A string decrypted on first use: its state flag and decryption function.
+struct LazyAccessor {
+  static constexpr uint8_t Ready = 2;
+  GlobalVariable *Flag;
+  Function *Dec;
+};
+} // namespace
+
+// Puts the fast path of Lazy in front of every instruction using GV (PHIs:
+// at the end of the incoming block), inline rather than in a function an
+// inliner would have to run after us for: an acquire load of the flag and
+// a branch, weighted as not taken, to a call of the decryption.
+static void routeUsesThrough(GlobalVariable &GV, const LazyAccessor &Lazy,
+                             const SmallPtrSetImpl<Constant *> &Reaching) {
+  LLVMContext &C = GV.getContext();
+  Type *I8 = Type::getInt8Ty(C);
+  for (Use *U : collectInstructionUses(GV, Reaching)) {
+    auto *I = cast<Instruction>(U->getUser());
+    Instruction *InsertPt = I;
+    if (auto *PN = dyn_cast<PHINode>(I))
+      InsertPt = PN->getIncomingBlock(*U)->getTerminator();
+    IRBuilder<> B(InsertPt);
+    LoadInst *State = B.CreateAlignedLoad(I8, Lazy.Flag, MaybeAlign(1));
+    State->setAtomic(AtomicOrdering::Acquire);
+    auto *NotReady = cast<Instruction>(
+        B.CreateICmpNE(State, ConstantInt::get(I8, LazyAccessor::Ready)));
+    Instruction *Then = SplitBlockAndInsertIfThen(
+        NotReady, InsertPt, /*Unreachable=*/false, neverTakenWeights(C));
+    CallInst *Call = CallInst::Create(Lazy.Dec, "", Then);
+    for (Instruction *New : {(Instruction *)State, NotReady,
+                             NotReady->getParent()->getTerminator(),
+                             (Instruction *)Call, Then})
+      obf::tagObfuscation(*New, "string");
+  }
+}
+
+// Whether every use of GV is a call argument the callee does not capture,
+// in a block of ColdBlocks(F): the string is only needed while the call
+// runs, and only rarely.
+static bool isOnlyPassedToColdCalls(
+    GlobalVariable &GV, const SmallPtrSetImpl<Constant *> &Reaching,
+    function_ref<const SmallPtrSetImpl<const BasicBlock *> &(Function &)>
+        ColdBlocks) {
+  for (Use *U : collectInstructionUses(GV, Reaching)) {
+    auto *CI = dyn_cast<CallInst>(U->getUser());
+    if (!CI || CI->isMustTailCall() || !CI->isArgOperand(U) ||
+        !CI->doesNotCapture(CI->getArgOperandNo(U)) ||
+        !ColdBlocks(*CI->getFunction()).count(CI->getParent()))
+      return false;
+  }
+  return true;
+}
+
+// Makes every call using GV decrypt it into a stack buffer first, with Copy,
+// and wipe the buffer right after. The buffer is one static alloca per
+// function, live only around each call.
+static void decryptOnStack(GlobalVariable &GV, Function &Copy, unsigned Size,
+                           const SmallPtrSetImpl<Constant *> &Reaching) {
+  LLVMContext &C = GV.getContext();
+  const DataLayout &DL = GV.getParent()->getDataLayout();
+  auto *BufTy = ArrayType::get(Type::getInt8Ty(C), Size);
+  DenseMap<Function *, AllocaInst *> Bufs;
+  DenseMap<Instruction *, Value *> Decrypted;
+  auto Tag = [](Value *V) {
+    obf::tagObfuscation(*cast<Instruction>(V), "string");
+  };
+  for (Use *U : collectInstructionUses(GV, Reaching)) {
+    auto *CI = cast<CallInst>(U->getUser());
+    Function &F = *CI->getFunction();
+    AllocaInst *&Buf = Bufs[&F];
+    if (!Buf) {
+      BasicBlock &Entry = F.getEntryBlock();
+      Buf = new AllocaInst(BufTy, DL.getAllocaAddrSpace(), GV.getName() + ".buf",
+                           &*Entry.getFirstInsertionPt());
+      Tag(Buf);
+    }
+    // Both operands of printf(s, s) share one decryption.
+    Value *&Ptr = Decrypted[CI];
+    if (!Ptr) {
+      // A tail call may not see the caller's stack.
+      CI->setTailCall(false);
+      IRBuilder<> B(CI);
+      Tag(B.CreateLifetimeStart(Buf, B.getInt64(Size)));
+      Tag(B.CreateCall(&Copy, {Buf}));
+      B.SetInsertPoint(CI->getNextNode());
+      Tag(B.CreateMemSet(Buf, B.getInt8(0), Size, MaybeAlign(1),
+                         /*isVolatile=*/true));
+      Tag(B.CreateLifetimeEnd(Buf, B.getInt64(Size)));
+      Ptr = Buf;
+    }
+    U->set(rebuildWith(cast<Constant>(U->get()), Ptr, Reaching, CI));
+  }
+}
+
+// Emits the cold helper decrypting a string of Len characters, encrypted
+// with Key in Enc, into the buffer it is passed, terminator included.
+static Function *createStackCopy(Module &M, GlobalVariable &GV,
+                                 GlobalVariable *Enc, unsigned Len,
+                                 uint8_t Key) {
+  LLVMContext &C = M.getContext();
+  Type *Ptr = PointerType::getUnqual(C);
+  Function *Copy = Function::Create(
+      FunctionType::get(Type::getVoidTy(C), {Ptr}, false),
+      GlobalValue::InternalLinkage, GV.getName() + ".copy", M);
+  Copy->addFnAttr(Attribute::Cold);
+  Copy->addFnAttr(Attribute::NoInline);
+  Copy->addFnAttr(Attribute::NoUnwind);
+  Copy->addParamAttr(0, Attribute::NoCapture);
+  obf::tagObfuscation(*Copy, "string");
+  IRBuilder<> B(BasicBlock::Create(C, "entry", Copy));
+  emitDecryptLoop(B, Enc, Copy->getArg(0), Len, Key);
+  B.CreateStore(B.getInt8(0),
+                B.CreateInBoundsGEP(B.getInt8Ty(), Copy->getArg(0),
+                                    B.getInt64(Len)));
+  B.CreateRetVoid();
+  return Copy;
+}
+
+// Emits the decryption of a string decrypted on first use. Flag goes from 0
+// (encrypted) to 1 (being decrypted) to 2 (plaintext): the first use to
+// claim it decrypts and publishes with a release store, any others spin
+// until then. Every use checks it inline (see routeUsesThrough).
+//
+//   void @str.dec()  ; cold, noinline
+//     if (cmpxchg acquire @flag, 0, 1) { decrypt; store atomic release 2 }
+//     else while (load atomic acquire @flag != 2) {}
+static LazyAccessor createLazyAccessor(Module &M, GlobalVariable &GV,
+                                       GlobalVariable *Enc, unsigned Len,
+                                       uint8_t Key) {
+  LLVMContext &C = M.getContext();
+  Type *I8 = Type::getInt8Ty(C);
+  auto *Flag = new GlobalVariable(M, I8, /*isConstant=*/false,
+                                  GlobalValue::PrivateLinkage,
+                                  ConstantInt::get(I8, 0),
+                                  GV.getName() + ".once");
+  obf::tagObfuscation(*Flag, "string");
+  Constant *Encrypted = ConstantInt::get(I8, 0);
+  Constant *Busy = ConstantInt::get(I8, 1);
+
+  Function *Dec = Function::Create(
+      FunctionType::get(Type::getVoidTy(C), false),
+      GlobalValue::InternalLinkage, GV.getName() + ".dec", M);
+  Dec->addFnAttr(Attribute::Cold);
+  Dec->addFnAttr(Attribute::NoInline);
+  Dec->addFnAttr(Attribute::NoUnwind);
+  obf::tagObfuscation(*Dec, "string");
+  BasicBlock *Entry = BasicBlock::Create(C, "entry", Dec);
+  BasicBlock *Claimed = BasicBlock::Create(C, "claimed", Dec);
+  BasicBlock *Wait = BasicBlock::Create(C, "wait", Dec);
+  BasicBlock *Done = BasicBlock::Create(C, "done", Dec);
+  IRBuilder<> B(Entry);
+  Value *Claim = B.CreateAtomicCmpXchg(Flag, Encrypted, Busy, MaybeAlign(1),
+                                       AtomicOrdering::Acquire,
+                                       AtomicOrdering::Acquire);
+  B.CreateCondBr(B.CreateExtractValue(Claim, 1), Claimed, Wait);
+  B.SetInsertPoint(Claimed);
+  emitDecryptLoop(B, Enc, Enc, Len, Key);
+  B.CreateAlignedStore(ConstantInt::get(I8, LazyAccessor::Ready), Flag,
+                       MaybeAlign(1))
+      ->setAtomic(AtomicOrdering::Release);
+  B.CreateRetVoid();
+  // Someone else is decrypting; it only takes a few hundred cycles.
+  B.SetInsertPoint(Wait);
+  LoadInst *State = B.CreateAlignedLoad(I8, Flag, MaybeAlign(1));
+  State->setAtomic(AtomicOrdering::Acquire);
+  B.CreateCondBr(
+      B.CreateICmpEQ(State, ConstantInt::get(I8, LazyAccessor::Ready)), Done,
+      Wait);
+  B.SetInsertPoint(Done);
+  B.CreateRetVoid();
+  return {Flag, Dec};
+}
+
+// The startup-decrypted strings are packed into one blob, encrypted with
+// a 32-byte key vector V and a step S: V[p % 32] + (p / 32) * S is added
+// to byte p, so a 32-byte chunk decrypts with one vector add and subtract.
+// Each cycle adds another such layer, and since layers add up, the blob
+// keeps one (V, S), the sums of its layers', in !obf.key until
+// stripStringKey drops it.
+static constexpr unsigned BlobKeySize = 32;
+
+namespace {
+struct BlobKey {
+  std::array<uint8_t, BlobKeySize> V{};
+  uint8_t Step = 0;
+  // Bytes of the blob holding strings; the rest is padding.
+  uint64_t Used = 0;
+  unsigned Layers = 0;
+
+  uint8_t at(uint64_t P) const {
+    return V[P % BlobKeySize] + (uint8_t)(P / BlobKeySize) * Step;
+  }
+  // Adds a layer drawn from RNG to the key and to Bytes.
+  void addLayer(std::mt19937_64 &RNG, MutableArrayRef<char> Bytes) {
+    BlobKey Layer;
+    for (uint8_t &K : Layer.V)
+      K = (uint8_t)RNG();
+    Layer.Step = (uint8_t)RNG();
+    for (uint64_t P = 0; P < Bytes.size(); ++P)
+      Bytes[P] = (char)(Bytes[P] + Layer.at(P));
+    for (unsigned I = 0; I < BlobKeySize; ++I)
+      V[I] += Layer.V[I];
+    Step += Layer.Step;
+    ++Layers;
+  }
+};
+} // namespace
+
+// The blob an earlier cycle made, and its key. Null once the key has been
+// stripped: that blob keeps its own constructor.
+static GlobalVariable *findBlob(Module &M, BlobKey &Key) {
+  for (GlobalVariable &GV : M.globals()) {
+    MDNode *MD = GV.getMetadata("obf.key");
+    if (!MD)
+      continue;
+    auto *V = cast<ConstantDataArray>(
+        cast<ConstantAsMetadata>(MD->getOperand(0))->getValue());
+    for (unsigned I = 0; I < BlobKeySize; ++I)
+      Key.V[I] = (uint8_t)V->getElementAsInteger(I);
+    Key.Step = mdconst::extract<ConstantInt>(MD->getOperand(1))->getZExtValue();
+    Key.Used = mdconst::extract<ConstantInt>(MD->getOperand(2))->getZExtValue();
+    Key.Layers =
+        mdconst::extract<ConstantInt>(MD->getOperand(3))->getZExtValue();
+    return &GV;
+  }
+  return nullptr;
+}
+
+static void setBlobKey(GlobalVariable &Blob, const BlobKey &Key) {
+  LLVMContext &C = Blob.getContext();
+  Metadata *Ops[] = {
+      ConstantAsMetadata::get(ConstantDataArray::get(C, ArrayRef<uint8_t>(Key.V))),
+      ConstantAsMetadata::get(ConstantInt::get(Type::getInt8Ty(C), Key.Step)),
+      ConstantAsMetadata::get(ConstantInt::get(Type::getInt64Ty(C), Key.Used)),
+      ConstantAsMetadata::get(
+          ConstantInt::get(Type::getInt32Ty(C), Key.Layers))};
+  Blob.setMetadata("obf.key", MDNode::get(C, Ops));
+}
+
+bool obf::stripStringKey(Module &M) {
+  bool Stripped = false;
+  for (GlobalVariable &GV : M.globals())
+    if (GV.hasMetadata("obf.key")) {
+      GV.setMetadata("obf.key", nullptr);
+      Stripped = true;
+    }
+  return Stripped;
+}
+
+// The constructor an earlier cycle made for Blob: the "string"-tagged
+// llvm.global_ctors entry that decrypts it. Program code may use Blob
+// directly too (the string at offset 0 folds to it), so its users alone
+// do not tell.
+static Function *findBlobInit(Module &M, GlobalVariable &Blob) {
+  GlobalVariable *Ctors = M.getNamedGlobal("llvm.global_ctors");
+  if (!Ctors || !Ctors->hasInitializer())
+    return nullptr;
+  auto *CA = dyn_cast<ConstantArray>(Ctors->getInitializer());
+  if (!CA)
+    return nullptr;
+  for (Value *Op : CA->operands()) {
+    auto *CS = dyn_cast<ConstantStruct>(Op);
+    if (!CS)
+      continue;
+    auto *F = dyn_cast<Function>(CS->getOperand(1)->stripPointerCasts());
+    if (!F || F->isDeclaration())
+      continue;
+    MDNode *Tag = F->getMetadata("obf");
+    if (!Tag || cast<MDString>(Tag->getOperand(0))->getString() != "string")
+      continue;
+    for (Instruction &I : instructions(*F))
+      for (Value *V : I.operands())
+        if (V->stripPointerCasts() == &Blob)
+          return F;
+  }
+  return nullptr;
+}
+
+// Vector width of the blob decrypt loop: 256-bit if the target has it,
+// 128-bit (SSE, NEON) otherwise.
+static unsigned getDecryptWidth(const Module &M) {
+  for (const Function &F : M)
+    if (F.getFnAttribute("target-features").getValueAsString().contains(
+            "+avx2"))
+      return 32;
+  return 16;
+}
+
+// Emits the loops decrypting the Size bytes of Blob at B, which is left
+// at the block after them: whole chunks Width bytes at a time, then the
+// remaining Size % 32 bytes one at a time. Neither depends on how many
+// strings the blob holds.
+static void emitBlobDecrypt(IRBuilder<> &B, GlobalVariable *Blob,
+                            uint64_t Size, const BlobKey &Key,
+                            unsigned Width) {
+  LLVMContext &C = B.getContext();
+  Function *F = B.GetInsertBlock()->getParent();
+  Type *I8 = B.getInt8Ty();
+  Type *I64 = B.getInt64Ty();
+  uint64_t Chunks = Size / BlobKeySize;
+
+  if (Chunks) {
+    BasicBlock *Preheader = B.GetInsertBlock();
+    BasicBlock *Loop = BasicBlock::Create(C, "dec.vec", F);
+    BasicBlock *After = BasicBlock::Create(C, "dec.vec.after", F);
+    B.CreateBr(Loop);
+    B.SetInsertPoint(Loop);
+    PHINode *I = B.CreatePHI(I64, 2, "chunk");
+    I->addIncoming(B.getInt64(0), Preheader);
+    Value *Off = B.CreateShl(I, Log2_32(BlobKeySize), "", /*HasNUW=*/true);
+    Value *Step = B.CreateVectorSplat(
+        Width, B.CreateMul(B.CreateTrunc(I, I8), B.getInt8(Key.Step)));
+    auto *VecTy = FixedVectorType::get(I8, Width);
+    for (unsigned Lane = 0; Lane < BlobKeySize; Lane += Width) {
+      Value *Ptr = B.CreateInBoundsGEP(
+          I8, Blob, B.CreateAdd(Off, B.getInt64(Lane), "", /*HasNUW=*/true));
+      Value *V = B.CreateAlignedLoad(VecTy, Ptr, Align(Width));
+      Value *K = B.CreateAdd(
+          ConstantDataVector::get(C, ArrayRef<uint8_t>(Key.V).slice(Lane, Width)),
+          Step);
+      B.CreateAlignedStore(B.CreateSub(V, K), Ptr, Align(Width));
+    }
+    Value *Next = B.CreateAdd(I, B.getInt64(1), "", /*HasNUW=*/true);
+    I->addIncoming(Next, Loop);
+    B.CreateCondBr(B.CreateICmpEQ(Next, B.getInt64(Chunks)), After, Loop);
+    B.SetInsertPoint(After);
+  }
+
+  uint64_t Tail = Size % BlobKeySize;
+  if (!Tail)
+    return;
+  BasicBlock *Preheader = B.GetInsertBlock();
+  BasicBlock *Loop = BasicBlock::Create(C, "dec.tail", F);
+  BasicBlock *After = BasicBlock::Create(C, "dec.tail.after", F);
+  B.CreateBr(Loop);
+  B.SetInsertPoint(Loop);
+  PHINode *J = B.CreatePHI(I64, 2, "j");
+  J->addIncoming(B.getInt64(0), Preheader);
+  Value *Ptr = B.CreateInBoundsGEP(
+      I8, Blob, B.CreateAdd(J, B.getInt64(Chunks * BlobKeySize)));
+  Value *K = B.CreateExtractElement(ConstantDataVector::get(C, ArrayRef<uint8_t>(Key.V)),
+                                    J);
+  K = B.CreateAdd(K, B.getInt8((uint8_t)Chunks * Key.Step));
+  B.CreateStore(B.CreateSub(B.CreateLoad(I8, Ptr), K), Ptr);
+  Value *Next = B.CreateAdd(J, B.getInt64(1), "", /*HasNUW=*/true);
+  J->addIncoming(Next, Loop);
+  B.CreateCondBr(B.CreateICmpEQ(Next, B.getInt64(Tail)), After, Loop);
+  B.SetInsertPoint(After);
+}
+
+// The largest page size the target's loaders may use, so a region aligned
+// and padded to it never shares a page with other data.
+static uint64_t getMaxPageSize(const Triple &T) {
+  if (T.isOSDarwin() && T.isAArch64())
+    return 16384;
+  if (T.isAArch64() || T.isPPC64())
+    return 65536;
+  return 4096;
+}
+
+// Emits a call at B making the Size bytes at Blob, whole pages, read-only:
+// mprotect(PROT_READ), or VirtualProtect(PAGE_READONLY) on Windows. A
+// failure only leaves the pages writable.
+static void emitProtectReadOnly(IRBuilder<> &B, GlobalVariable *Blob,
+                                uint64_t Size) {
+  Module &M = *Blob->getParent();
+  Triple T(M.getTargetTriple());
+  Type *IntPtr = M.getDataLayout().getIntPtrType(B.getContext());
+  Type *Ptr = Blob->getType();
+  if (T.isOSWindows()) {
+    FunctionCallee Protect = M.getOrInsertFunction(
+        "VirtualProtect", B.getInt32Ty(), Ptr, IntPtr, B.getInt32Ty(), Ptr);
+    // The old protection has to go somewhere.
+    Value *Old = B.CreateAlloca(B.getInt32Ty());
+    CallInst *CI = B.CreateCall(Protect, {Blob, ConstantInt::get(IntPtr, Size),
+                                          B.getInt32(/*PAGE_READONLY=*/2), Old});
+    if (T.getArch() == Triple::x86) {
+      cast<Function>(Protect.getCallee())
+          ->setCallingConv(CallingConv::X86_StdCall);
+      CI->setCallingConv(CallingConv::X86_StdCall);
+    }
+    return;
+  }
+  FunctionCallee Protect = M.getOrInsertFunction(
+      "mprotect", B.getInt32Ty(), Ptr, IntPtr, B.getInt32Ty());
+  B.CreateCall(Protect, {Blob, ConstantInt::get(IntPtr, Size),
+                         B.getInt32(/*PROT_READ=*/1)});
+}
+
+obf::StringObfuscationResult
+obf::runStringObfuscation(Module &M, const ObfuscationOptions &Opts,
+                          FunctionAnalysisManager *FAM) {
+  unsigned Count = 0, MaxLevel = 0, LazyCount = 0, StackCount = 0;
+  uint64_t Bytes = 0, DirtyPages = 0;
+  LLVMContext &C = M.getContext();
+  std::vector<GlobalVariable*> toReplace;
+  for (GlobalVariable &GV : M.globals()) {
+    // Skip our own ciphertexts and strings an earlier cycle already handled.
+    if (!GV.hasInitializer() || obf::isObfuscation(GV)) continue;
+    if (GV.getValueType()->isArrayTy()) {
+      if (GV.getName().starts_with("str.")) {
+        toReplace.push_back(&GV);
       }
     }
+  }
+
+  // Strings decrypted at startup, packed back to back (terminators
+  // included) into Packed; Offsets[i] is where Packed[i] starts.
+  std::vector<GlobalVariable *> PackedGVs;
+  std::vector<uint64_t> Offsets;
+  std::string Packed;
+  // Where the remark goes: __obf_init, or without it the first <str>.dec
+  // or <str>.copy.
+  Function *RemarkF = nullptr;
+
+  // Cold blocks per function, found when a string first asks.
+  std::optional<ProfileSummaryInfo> PSI;
+  if (M.getProfileSummary(/*IsCS=*/false))
+    PSI.emplace(M);
+  DenseMap<Function *, SmallPtrSet<const BasicBlock *, 8>> ColdBlocks;
+  auto GetColdBlocks =
+      [&](Function &F) -> const SmallPtrSetImpl<const BasicBlock *> & {
+    auto It = ColdBlocks.find(&F);
+    if (It == ColdBlocks.end())
+      It = ColdBlocks
+               .try_emplace(&F, obf::findColdBlocks(F, PSI ? &*PSI : nullptr))
+               .first;
+    return It->second;
+  };
+
+  for (GlobalVariable *GV : toReplace) {
+    Constant *init = GV->getInitializer();
+    if (ConstantDataArray *CDA = dyn_cast<ConstantDataArray>(init)) {
+      if (!CDA->isCString()) continue;
+      unsigned Level = getStringLevel(*GV, Opts);
+      if (!Level) continue;
+      MaxLevel = std::max(MaxLevel, Level);
+      StringRef s = CDA->getAsCString();
+      Count++;
+      Bytes += s.size();
 
-    // If we created an init function, finish it and register in global_ctors
-    if (initF) {
-      IRBuilder<> endB(&initF->back());
-      if (!initF->back().getTerminator())
-        endB.CreateRetVoid();
-      // Add to llvm.global_ctors with priority 65535
-      Type *i32Ty = Type::getInt32Ty(C);
-      Type *voidPtrTy = PointerType::getUnqual(Type::getInt8Ty(C));
-      StructType *CtorTy = StructType::get(i32Ty, initF->getType()->getPointerTo(), voidPtrTy);
-      Constant *Ctor = ConstantStruct::get(CtorTy, ConstantInt::get(i32Ty, 65535), initF, ConstantPointerNull::get(cast<PointerType>(voidPtrTy)));
-      ArrayType *AT = ArrayType::get(CtorTy, 1);
-      GlobalVariable *GVctors = M.getGlobalVariable("llvm.global_ctors");
-      if (!GVctors) {
-        GVctors = new GlobalVariable(M, AT, false, GlobalValue::AppendingLinkage, nullptr, "llvm.global_ctors");
+      // Strings only instructions use can be decrypted on first use or on
+      // the stack; the uses in a lazily loaded module are not known yet.
+      // With cowStrings every cached copy is in the blob, since one
+      // decrypted on first use would be decrypted again in each process.
+      bool Lazy = Opts.lazyStrings && !Opts.cowStrings;
+      SmallPtrSet<Constant *, 8> Reaching;
+      if ((Lazy || Opts.stackStrings) && !M.getMaterializer())
+        Reaching = findInstructionOnlyUses(*GV);
+      // Strings cold calls alone need go on the stack, the rest stay cached.
+      bool OnStack = Opts.stackStrings && !Reaching.empty() &&
+                     isOnlyPassedToColdCalls(*GV, Reaching, GetColdBlocks);
+      if (!OnStack && !Lazy)
+        Reaching.clear();
+      if (Reaching.empty()) {
+        PackedGVs.push_back(GV);
+        Offsets.push_back(Packed.size());
+        Packed.append(s.begin(), s.end());
+        Packed.push_back('\0');
+        continue;
       }
-      GVctors->setInitializer(ConstantArray::get(AT, {Ctor}));
+
+      // A key per string, drawn before the plaintext goes away. Ciphertext
+      // only ever decrypted onto the stack stays read-only.
+      uint8_t key = (uint8_t)makeRNG(Opts.seed, GV->getName(), Level)();
+      Constant *newInit = encryptString(C, s, key);
+      GlobalVariable *gEnc = new GlobalVariable(M, newInit->getType(), /*isConstant*/OnStack, GlobalValue::PrivateLinkage, newInit, GV->getName() + ".enc");
+      obf::tagObfuscation(*gEnc, "string");
+
+      Function *Helper;
+      if (OnStack) {
+        Helper = createStackCopy(M, *GV, gEnc, s.size(), key);
+        decryptOnStack(*GV, *Helper, s.size() + 1, Reaching);
+        ++StackCount;
+      } else {
+        LazyAccessor Lazy = createLazyAccessor(M, *GV, gEnc, s.size(), key);
+        routeUsesThrough(*GV, Lazy, Reaching);
+        Helper = Lazy.Dec;
+        ++LazyCount;
+      }
+      if (!RemarkF)
+        RemarkF = Helper;
+
+      // Replace original GV with pointer to encrypted global; the plaintext
+      // goes away unless something outside the module can still see it.
+      GV->replaceAllUsesWith(ConstantExpr::getBitCast(gEnc, GV->getType()));
+      if (GV->hasLocalLinkage())
+        GV->eraseFromParent();
+      else
+        obf::tagObfuscation(*GV, "string");
+    }
+  }
+
+  // Append the packed strings to the blob, add a layer to all of it and
+  // decrypt it at startup. Each layer is drawn from the blob's contents,
+  // so it changes with the strings but not with the module's name or the
+  // order of passes.
+  BlobKey Key;
+  GlobalVariable *OldBlob = findBlob(M, Key);
+  uint64_t OldPages = 0;
+  if (!Packed.empty() || OldBlob) {
+    // With cowStrings the blob fills whole pages of its own, which turn
+    // read-only once decrypted; processes forked after that share them.
+    // Otherwise its pages may be shared with other data.
+    uint64_t PageSize = getMaxPageSize(Triple(M.getTargetTriple()));
+    uint64_t BlobAlign = Opts.cowStrings ? PageSize : BlobKeySize;
+    auto PagesFor = [&](uint64_t Size, uint64_t Alignment) {
+      return divideCeil(Size + PageSize - Alignment, PageSize);
+    };
+
+    // The earlier strings keep their offsets; the new ones go where its
+    // padding started, encrypted with the key so far.
+    std::string Data;
+    if (OldBlob) {
+      StringRef Old =
+          cast<ConstantDataArray>(OldBlob->getInitializer())->getRawDataValues();
+      OldPages = PagesFor(Old.size(), OldBlob->getAlign().valueOrOne().value());
+      Data = Old.take_front(Key.Used).str();
+    }
+    uint64_t Base = Data.size();
+    for (uint64_t P = 0; P < Packed.size(); ++P)
+      Data.push_back((char)(Packed[P] + Key.at(Base + P)));
+    Key.Used = Data.size();
+    if (Opts.cowStrings)
+      Data.resize(alignTo(Data.size(), PageSize), '\0');
+    std::mt19937_64 RNG = makeRNG(Opts.seed, "__obf_strings",
+                                  xxHash64(StringRef(Data)) + Key.Layers);
+    Key.addLayer(RNG, MutableArrayRef<char>(Data.data(), Data.size()));
+    DirtyPages = PagesFor(Data.size(), BlobAlign);
+
+    Constant *BlobInit =
+        ConstantDataArray::getRaw(Data, Data.size(), Type::getInt8Ty(C));
+    auto *Blob = new GlobalVariable(M, BlobInit->getType(),
+                                    /*isConstant=*/false,
+                                    GlobalValue::PrivateLinkage, BlobInit,
+                                    "__obf_strings");
+    Blob->setAlignment(Align(BlobAlign));
+    obf::tagObfuscation(*Blob, "string");
+    setBlobKey(*Blob, Key);
+
+    // Each use of a string becomes a constant offset into the blob; the
+    // plaintext goes away unless something outside the module can still
+    // see it.
+    for (size_t I = 0; I < PackedGVs.size(); ++I) {
+      GlobalVariable *GV = PackedGVs[I];
+      Constant *Idx[] = {
+          ConstantInt::get(Type::getInt64Ty(C), 0),
+          ConstantInt::get(Type::getInt64Ty(C), Base + Offsets[I])};
+      GV->replaceAllUsesWith(ConstantExpr::getPointerCast(
+          ConstantExpr::getInBoundsGetElementPtr(Blob->getValueType(), Blob,
+                                                 Idx),
+          GV->getType()));
+      if (GV->hasLocalLinkage())
+        GV->eraseFromParent();
+      else
+        obf::tagObfuscation(*GV, "string");
+    }
+
+    // One loop decrypts all layers. It replaces the earlier cycle's
+    // constructor in place, so llvm.global_ctors keeps one entry for it
+    // next to the program's own.
+    Function *OldInit = OldBlob ? findBlobInit(M, *OldBlob) : nullptr;
+    FunctionType *FT = FunctionType::get(Type::getVoidTy(C), false);
+    Function *initF =
+        Function::Create(FT, GlobalValue::InternalLinkage, "__obf_init", M);
+    obf::tagObfuscation(*initF, "string");
+    IRBuilder<> initBuilder(BasicBlock::Create(C, "entry", initF));
+    emitBlobDecrypt(initBuilder, Blob, Data.size(), Key, getDecryptWidth(M));
+    if (Opts.cowStrings)
+      emitProtectReadOnly(initBuilder, Blob, Data.size());
+    initBuilder.CreateRetVoid();
+    RemarkF = initF;
+
+    if (OldBlob) {
+      OldBlob->replaceAllUsesWith(Blob);
+      Blob->takeName(OldBlob);
+      OldBlob->eraseFromParent();
+    }
+    if (OldInit) {
+      OldInit->replaceAllUsesWith(initF);
+      initF->takeName(OldInit);
+      if (FAM)
+        FAM->clear(*OldInit, OldInit->getName());
+      OldInit->eraseFromParent();
+    } else {
+      appendToGlobalCtors(M, initF, 65535);
+    }
+  }
+
+  // Earlier cycles reported the pages the blob had then.
+  DirtyPages = DirtyPages > OldPages ? DirtyPages - OldPages : 0;
+  if (Count || OldBlob) {
+    NumStringsEncrypted += Count;
+    NumStringBytes += Bytes;
+    NumLazyStrings += LazyCount;
+    NumStackStrings += StackCount;
+    NumDirtyPages += DirtyPages;
+    OptimizationRemarkEmitter ORE(RemarkF);
+    ORE.emit([&] {
+      return OptimizationRemark(DEBUG_TYPE, "StringsEncrypted", RemarkF)
+             << "encrypted " << ore::NV("Strings", Count) << " strings ("
+             << ore::NV("Bytes", Bytes) << " bytes) at level up to "
+             << ore::NV("Level", MaxLevel) << ", "
+             << ore::NV("LazyStrings", LazyCount) << " decrypted on first use, "
+             << ore::NV("StackStrings", StackCount) << " on the stack; "
+             << "startup decryption takes " << ore::NV("Layers", Key.Layers)
+             << " layers in one pass and dirties up to "
+             << ore::NV("DirtyPages", DirtyPages) << " more pages";
+    });
+  }
+  return {Count, Count || OldBlob};
+}
+
+static bool shouldObfuscate(const Function &F) {
+  if (F.isDeclaration()) return false;
+  if (F.getName().starts_with("llvm.")) return false;
+  // ThinLTO imports: the copy is dropped after optimization.
+  if (F.hasAvailableExternallyLinkage()) return false;
+  // Functions we generated ourselves, such as __obf_init.
+  if (obf::isObfuscation(F)) return false;
+  return !obf::isObfuscationDisabled(F);
+}
+
+PreservedAnalyses obf::obfuscateFunction(Function &F,
+                                        const ObfuscationOptions &Opts,
+                                        FunctionAnalysisManager &FAM,
+                                        ProfileSummaryInfo *PSI,
+                                        bool RegionTimers, ObfuscationStats &S) {
+  if (!shouldObfuscate(F))
+    return PreservedAnalyses::all();
+  obf::ObfuscationOptions FnOpts = obf::getFunctionOptions(F, Opts);
+  S.instsBefore = F.getInstructionCount();
+  S.blocksBefore = F.size();
+
+  std::optional<obf::FunctionCache> Cache;
+  std::optional<std::string> Key;
+  if (!FnOpts.cacheDir.empty()) {
+    TransformTimer T("cache", "FunctionCache", F.getName(), RegionTimers);
+    Cache.emplace(FnOpts.cacheDir);
+    Key = Cache->key(F, FnOpts,
+                     FnOpts.bogusBlocksPerFunction || FnOpts.costBudget
+                         ? &FAM.getResult<TargetIRAnalysis>(F)
+                         : nullptr);
+  }
+  PreservedAnalyses PA = PreservedAnalyses::none();
+  if (Key && Cache->restore(F, *Key, FnOpts, S)) {
+    ++NumCacheHits;
+    NumBogusBlocks += S.bogusBlocks;
+    NumNops += S.nops;
+    NumFakeLoops += S.fakeLoops;
+  } else {
+    // Only bogus blocks keep DT/LI up to date and need BFI and TTI to place
+    // and cost them, so don't compute them otherwise.
+    DominatorTree *DT = nullptr;
+    LoopInfo *LI = nullptr;
+    BlockFrequencyInfo *BFI = nullptr;
+    const TargetTransformInfo *TTI = nullptr;
+    if (FnOpts.bogusBlocksPerFunction) {
+      DT = &FAM.getResult<DominatorTreeAnalysis>(F);
+      LI = &FAM.getResult<LoopAnalysis>(F);
+      BFI = &FAM.getResult<BlockFrequencyAnalysis>(F);
+      TTI = &FAM.getResult<TargetIRAnalysis>(F);
+    }
+    obf::HotBlockSet Hot = obf::findHotBlocks(F, FnOpts, FAM, PSI);
+    S.hotBlocks = Hot.size();
+    std::optional<obf::CostBudget> Costs;
+    if (FnOpts.costBudget)
+      Costs.emplace(F, FnOpts.costBudget, FAM.getResult<TargetIRAnalysis>(F),
+                    FAM.getResult<BlockFrequencyAnalysis>(F));
+    PA = FunctionObfuscator(F, S, DT, LI, BFI, TTI, RegionTimers, FnOpts.seed,
+                            Hot,
+                            Costs ? &*Costs : nullptr)
+             .run(FnOpts);
+    if (Costs) {
+      Costs->save();
+      S.budgetUsed = Costs->percentUsed();
+    }
+    if (Key) {
+      Cache->store(F, *Key, S);
+      ++NumCacheMisses;
     }
   }
+  S.instsAfter = F.getInstructionCount();
+  S.blocksAfter = F.size();
+  ++NumFunctions;
+  if (S.growthCapped)
+    ++NumGrowthCapped;
+  if (S.budgetExhausted)
+    ++NumBudgetExhausted;
+  NumInstsAdded += S.instsAfter - S.instsBefore;
+  NumBlocksAdded += S.blocksAfter - S.blocksBefore;
+  obf::emitFunctionRemark(FAM.getResult<OptimizationRemarkEmitterAnalysis>(F),
+                          F, S);
+  return PA;
+}
+
+void obf::emitFunctionRemark(OptimizationRemarkEmitter &ORE, const Function &F,
+                             const ObfuscationStats &S) {
+  ORE.emit([&] {
+    return OptimizationRemark(DEBUG_TYPE, "FunctionObfuscated", &F)
+           << "inserted " << ore::NV("BogusBlocks", S.bogusBlocks)
+           << " bogus blocks, " << ore::NV("Nops", S.nops) << " nops, "
+           << ore::NV("FakeLoops", S.fakeLoops) << " fake loops; instructions "
+           << ore::NV("InstsBefore", S.instsBefore) << " -> "
+           << ore::NV("InstsAfter", S.instsAfter) << ", blocks "
+           << ore::NV("BlocksBefore", S.blocksBefore) << " -> "
+           << ore::NV("BlocksAfter", S.blocksAfter) << ", hot blocks avoided "
+           << ore::NV("HotBlocks", S.hotBlocks) << ", predicates "
+           << ore::NV("AluPredicates", S.aluPredicates) << " alu/"
+           << ore::NV("AlgebraicPredicates", S.algebraicPredicates)
+           << " algebraic/" << ore::NV("StatePredicates", S.statePredicates)
+           << " state with latency "
+           << ore::NV("PredicateLatency", S.predicateLatency)
+           << ", cost budget used "
+           << ore::NV("BudgetUsed", S.budgetUsed) << "%; from cache: "
+           << ore::NV("FromCache", S.fromCache) << ", growth capped: "
+           << ore::NV("GrowthCapped", S.growthCapped) << ", budget exhausted: "
+           << ore::NV("BudgetExhausted", S.budgetExhausted);
+  });
+}
+
+PreservedAnalyses
+obf::ObfuscationFunctionPass::run(Function &F, FunctionAnalysisManager &FAM) {
+  ObfuscationStats S;
+  ProfileSummaryInfo *PSI =
+      FAM.getResult<ModuleAnalysisManagerFunctionProxy>(F)
+          .getCachedResult<ProfileSummaryAnalysis>(*F.getParent());
+  return obfuscateFunction(F, Options, FAM, PSI, RegionTimers, S);
+}
+
+// A TargetMachine for M's triple, so the TTI behind predicate latencies and
+// the cost budget is the one a pipeline for M would use; CPU and features
+// come from each function's attributes there as well. Null if the target
+// is unknown (or not initialized), which leaves the default TTI.
+static std::unique_ptr<TargetMachine> createTargetMachine(const Module &M) {
+  std::string Error;
+  const Target *T = TargetRegistry::lookupTarget(M.getTargetTriple(), Error);
+  if (!T)
+    return nullptr;
+  return std::unique_ptr<TargetMachine>(T->createTargetMachine(
+      M.getTargetTriple(), "", "", TargetOptions(), /*RM=*/std::nullopt));
+}
+
+obf::FunctionStatsList obf::obfuscateFunctions(Module &M,
+                                               const ObfuscationOptions &Opts,
+                                               bool RegionTimers) {
+  // One per call: TargetMachine's subtarget cache is not thread-safe.
+  std::unique_ptr<TargetMachine> TM = createTargetMachine(M);
+  PassBuilder PB(TM.get());
+  FunctionAnalysisManager FAM;
+  PB.registerFunctionAnalyses(FAM);
+  // No module proxy here to find a cached summary through.
+  std::optional<ProfileSummaryInfo> PSI;
+  if (M.getProfileSummary(/*IsCS=*/false))
+    PSI.emplace(M);
+  FunctionStatsList Result;
+  for (Function &F : M) {
+    if (!shouldObfuscate(F))
+      continue;
+    ObfuscationStats S;
+    FAM.invalidate(F, obfuscateFunction(F, Opts, FAM, PSI ? &*PSI : nullptr,
+                                        RegionTimers, S));
+    Result.emplace_back(F.getName().str(), S);
+  }
+  return Result;
+}
+
+PreservedAnalyses obf::StripStringKeyPass::run(Module &M,
+                                               ModuleAnalysisManager &) {
+  return stripStringKey(M) ? PreservedAnalyses::none()
+                           : PreservedAnalyses::all();
+}
 
-  // (optional) more helpers...
+PreservedAnalyses obf::StringObfuscationPass::run(Module &M,
+                                                  ModuleAnalysisManager &MAM) {
+  FunctionAnalysisManager &FAM =
+      MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  StringObfuscationResult R;
+  {
+    TransformTimer T("strings", "StringEncryption", M.getName());
+    R = runStringObfuscation(M, Options, &FAM);
+  }
+  if (!R.Changed)
+    return PreservedAnalyses::all();
+  // Only operands of existing functions change; their CFGs stay intact. A
+  // later cycle erases the constructor it replaces, so the proxy goes.
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
+
+static void runOnModule(Module &M, const obf::ObfuscationOptions &Opts) {
+  obf::applyObfuscationScope(M, Opts);
+  if (Opts.partitions > 1) {
+    std::vector<obf::FunctionStatsList> PartStats(Opts.partitions);
+    obf::runPartitioned(M, Opts.partitions, Opts.threads,
+                        [&](Module &Part, unsigned I) {
+                          PartStats[I] = obf::obfuscateFunctions(
+                              Part, Opts, /*RegionTimers=*/false);
+                        });
+    // Partition contexts have no remark streamer; report from M instead.
+    for (const obf::FunctionStatsList &Part : PartStats)
+      for (const auto &[Name, S] : Part)
+        if (Function *F = M.getFunction(Name)) {
+          OptimizationRemarkEmitter ORE(F);
+          obf::emitFunctionRemark(ORE, *F, S);
+        }
+  } else {
+    obf::obfuscateFunctions(M, Opts);
+  }
+
+  TransformTimer T("strings", "StringEncryption", M.getName());
+  obf::runStringObfuscation(M, Opts);
+}
+
+PreservedAnalyses obf::ObfuscationModulePass::run(Module &M,
+                                                  ModuleAnalysisManager &MAM) {
+  ObfuscationOptions Opts;
+  if (Options)
+    Opts = *Options;
+  else
+    parseOptionsFromModule(M, Opts);
+  runOnModule(M, Opts);
+  return PreservedAnalyses::none();
+}
+
+namespace {
+class ObfuscationLegacyPass : public ModulePass {
+public:
+  static char ID;
+
+  ObfuscationLegacyPass() : ModulePass(ID) {}
+
+  bool runOnModule(Module &M) override {
+    // Read options from module metadata (simple approach)
+    obf::ObfuscationOptions Opts;
+    parseOptionsFromModule(M, Opts);
+    ::runOnModule(M, Opts);
+    return true;
+  }
 };
 }
 
 char ObfuscationLegacyPass::ID = 0;
 static RegisterPass<ObfuscationLegacyPass> X("obf-legacy", "Simple Obfuscation Pass", false, false);
 
+// Splits "name<params>" into its parameter list; false if Name is not Pass.
+static bool parsePassName(StringRef Name, StringRef Pass, StringRef &Params) {
+  if (!Name.consume_front(Pass))
+    return false;
+  if (Name.empty()) {
+    Params = "";
+    return true;
+  }
+  if (!Name.consume_front("<") || !Name.consume_back(">"))
+    return false;
+  Params = Name;
+  return true;
+}
+
+static std::optional<obf::ObfuscationOptions> parseOptions(StringRef Params) {
+  Expected<obf::ObfuscationOptions> Opts = obf::parseObfuscationOptions(Params);
+  if (!Opts) {
+    errs() << toString(Opts.takeError()) << "\n";
+    return std::nullopt;
+  }
+  return *Opts;
+}
+
+// The obf<...> pipeline element: per-function transforms, then strings.
+static void addObfuscationPasses(ModulePassManager &MPM,
+                                 const obf::ObfuscationOptions &Opts) {
+  obf::addProfileLoader(MPM, Opts);
+  if (Opts.partitions > 1) {
+    MPM.addPass(obf::ObfuscationModulePass(Opts));
+    return;
+  }
+  MPM.addPass(obf::ObfuscationScopePass(Opts));
+  MPM.addPass(createModuleToFunctionPassAdaptor(
+      obf::ObfuscationFunctionPass(Opts)));
+  MPM.addPass(obf::StringObfuscationPass(Opts));
+}
+
+// With -flto the `last` extension point moves to link time: the pre-link
+// pipeline only records its parameters in !obf.lto, and the link-time
+// pipeline (each ThinLTO backend, or the merged full-LTO module) obfuscates
+// with them after cross-module inlining. Keeping them in the module also
+// keys the ThinLTO cache on them, and the linker needs no options.
+static constexpr StringLiteral DeferredMDName = "obf.lto";
+
 namespace {
-class ObfuscationModernPass : public PassInfoMixin<ObfuscationModernPass> {
+class DeferObfuscationPass : public PassInfoMixin<DeferObfuscationPass> {
+  std::string Params;
+  unsigned Cycles;
+
+public:
+  DeferObfuscationPass(StringRef Params, unsigned Cycles)
+      : Params(Params), Cycles(Cycles) {}
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    LLVMContext &C = M.getContext();
+    NamedMDNode *MD = M.getOrInsertNamedMetadata(DeferredMDName);
+    MD->clearOperands();
+    MD->addOperand(MDTuple::get(
+        C, {MDString::get(C, Params),
+            ConstantAsMetadata::get(
+                ConstantInt::get(Type::getInt32Ty(C), Cycles))}));
+    return PreservedAnalyses::all();
+  }
+};
+
+// Full LTO merges !obf.lto from every module; the first one wins.
+class LinkTimeObfuscationPass
+    : public PassInfoMixin<LinkTimeObfuscationPass> {
 public:
-  PreservedAnalyses run(Module &M, ModuleAnalysisManager &AM) {
-    ObfuscationLegacyPass L;
-    L.runOnModule(M);
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    NamedMDNode *MD = M.getNamedMetadata(DeferredMDName);
+    if (!MD || MD->getNumOperands() == 0)
+      return PreservedAnalyses::all();
+    MDNode *N = MD->getOperand(0);
+    auto *Params = N->getNumOperands() == 2
+                       ? dyn_cast<MDString>(N->getOperand(0))
+                       : nullptr;
+    auto *Cycles = Params ? mdconst::dyn_extract<ConstantInt>(N->getOperand(1))
+                          : nullptr;
+    if (!Cycles)
+      report_fatal_error("obf: malformed !" + DeferredMDName,
+                         /*gen_crash_diag=*/false);
+    Expected<obf::ObfuscationOptions> Opts =
+        obf::parseObfuscationOptions(Params->getString());
+    if (!Opts)
+      report_fatal_error(Opts.takeError(), /*gen_crash_diag=*/false);
+    M.eraseNamedMetadata(MD);
+    for (uint64_t I = 0; I < Cycles->getZExtValue(); ++I)
+      runOnModule(M, *Opts);
+    obf::stripStringKey(M);
     return PreservedAnalyses::none();
   }
 };
+} // namespace
+
+// Where the plugin runs inside the default pipelines (clang -O<n>
+// -fpass-plugin, opt -passes='default<O3>'). Clang only knows these options
+// if the plugin is also loaded with -fplugin= before -mllvm is parsed.
+// Loading the plugin alone obfuscates nothing: either option opts in.
+static cl::opt<std::string> ExtensionPoints(
+    "obf-ep", cl::init("last"),
+    cl::desc("Comma-separated default-pipeline extension points to obfuscate "
+             "at: start, scalar-late, vectorizer-start, last (the default "
+             "once this or -obf-params is given), or none"));
+static cl::opt<std::string>
+    ExtensionPointParams("obf-params", cl::init(""),
+                         cl::desc("Parameters for the extension-point passes, "
+                                  "as for obf<...>"));
+static cl::opt<unsigned>
+    ExtensionPointCycles("obf-cycles", cl::init(1),
+                         cl::desc("Obfuscation cycles at each extension point"));
+
+static void registerExtensionPoints(PassBuilder &PB) {
+  bool Start = false, ScalarLate = false, VectorizerStart = false,
+       Last = false;
+  SmallVector<StringRef, 4> Names;
+  if (ExtensionPoints.getNumOccurrences() ||
+      ExtensionPointParams.getNumOccurrences())
+    StringRef(ExtensionPoints).split(Names, ',', -1, /*KeepEmpty=*/false);
+  for (StringRef Name : Names) {
+    Name = Name.trim();
+    if (Name == "start")
+      Start = true;
+    else if (Name == "scalar-late")
+      ScalarLate = true;
+    else if (Name == "vectorizer-start")
+      VectorizerStart = true;
+    else if (Name == "last")
+      Last = true;
+    else if (Name != "none")
+      report_fatal_error("obf: unknown extension point '" + Name + "'",
+                         /*gen_crash_diag=*/false);
+  }
+  Expected<obf::ObfuscationOptions> Parsed =
+      obf::parseObfuscationOptions(ExtensionPointParams);
+  if (!Parsed)
+    report_fatal_error(Parsed.takeError(), /*gen_crash_diag=*/false);
+  obf::ObfuscationOptions Opts = *Parsed;
+  // The function extension points run inside the CGSCC pipeline, whose call
+  // graph cannot take the functions cold-bogus outlines into.
+  if ((ScalarLate || VectorizerStart) && Opts.outlineBogus)
+    report_fatal_error("obf: cold-bogus needs a module extension point "
+                       "(start or last), not scalar-late or vectorizer-start",
+                       /*gen_crash_diag=*/false);
+  // A profile only matches the IR it was collected on, which is gone once
+  // the pipeline has optimized it; later points use the summary clang's
+  // -fprofile-use= left in the module.
+  if (!Opts.profileFile.empty() && !Start)
+    report_fatal_error("obf: profile= needs -obf-ep=start; compile with "
+                       "-fprofile-use= or -fprofile-sample-use= instead",
+                       /*gen_crash_diag=*/false);
+  obf::ObfuscationOptions StartOpts = Opts;
+  Opts.profileFile.clear();
+  unsigned Cycles = std::max(1u, ExtensionPointCycles.getValue());
+
+  auto AddModule = [Opts, Cycles](ModulePassManager &MPM) {
+    for (unsigned I = 0; I < Cycles; ++I)
+      addObfuscationPasses(MPM, Opts);
+  };
+  auto AddFunction = [Opts, Cycles](FunctionPassManager &FPM) {
+    for (unsigned I = 0; I < Cycles; ++I)
+      FPM.addPass(obf::ObfuscationFunctionPass(Opts));
+  };
+  if (Start)
+    PB.registerPipelineStartEPCallback(
+        [StartOpts, Opts, Cycles](ModulePassManager &MPM, OptimizationLevel) {
+          for (unsigned I = 0; I < Cycles; ++I)
+            addObfuscationPasses(MPM, I ? Opts : StartOpts);
+        });
+  // Annotations and the policy need the whole module; the function
+  // extension points get them resolved up front.
+  if ((ScalarLate || VectorizerStart) && !Start)
+    PB.registerPipelineStartEPCallback(
+        [Opts](ModulePassManager &MPM, OptimizationLevel) {
+          MPM.addPass(obf::ObfuscationScopePass(Opts));
+        });
+  if (ScalarLate)
+    PB.registerScalarOptimizerLateEPCallback(
+        [AddFunction](FunctionPassManager &FPM, OptimizationLevel) {
+          AddFunction(FPM);
+        });
+  if (VectorizerStart)
+    PB.registerVectorizerStartEPCallback(
+        [AddFunction](FunctionPassManager &FPM, OptimizationLevel) {
+          AddFunction(FPM);
+        });
+  // The function extension points cannot encrypt strings; that happens at
+  // the end of the pipeline unless a module extension point already does.
+  bool StringsLast = (ScalarLate || VectorizerStart) && !Start;
+  SmallVector<StringRef, 8> Kept;
+  StringRef(ExtensionPointParams).split(Kept, ';', -1, /*KeepEmpty=*/false);
+  llvm::erase_if(Kept, [](StringRef P) { return P.starts_with("profile="); });
+  std::string Params = join(Kept, ";");
+  // The string key stays in the module only while a later cycle of this
+  // pipeline may still add a layer; link time starts a blob of its own.
+  PB.registerOptimizerLastEPCallback(
+      [AddModule, Opts, Start, Last, StringsLast, Params,
+       Cycles](ModulePassManager &MPM, OptimizationLevel,
+               ThinOrFullLTOPhase Phase) {
+        switch (Phase) {
+        case ThinOrFullLTOPhase::ThinLTOPreLink:
+        case ThinOrFullLTOPhase::FullLTOPreLink:
+          if (Last) {
+            MPM.addPass(DeferObfuscationPass(Params, Cycles));
+            if (Start)
+              MPM.addPass(obf::StripStringKeyPass());
+            return;
+          }
+          break;
+        case ThinOrFullLTOPhase::ThinLTOPostLink:
+          // One ThinLTO backend per module, run in parallel by the linker.
+          MPM.addPass(LinkTimeObfuscationPass());
+          return;
+        default:
+          break;
+        }
+        if (Last)
+          AddModule(MPM);
+        else if (StringsLast)
+          MPM.addPass(obf::StringObfuscationPass(Opts));
+        if (Start || Last || StringsLast)
+          MPM.addPass(obf::StripStringKeyPass());
+      });
+  PB.registerFullLinkTimeOptimizationLastEPCallback(
+      [](ModulePassManager &MPM, OptimizationLevel) {
+        MPM.addPass(LinkTimeObfuscationPass());
+      });
 }
 
 extern "C" LLVM_ATTRIBUTE_WEAK PassPluginLibraryInfo llvmGetPassPluginInfo() {
   return {
       LLVM_PLUGIN_API_VERSION, "obfpass", "0.1",
       [](PassBuilder &PB) {
+        registerExtensionPoints(PB);
         PB.registerPipelineParsingCallback(
             [](StringRef Name, ModulePassManager &MPM,
                ArrayRef<PassBuilder::PipelineElement>) {
               if (Name == "obf-legacy") {
-                MPM.addPass(ObfuscationModernPass());
+                MPM.addPass(obf::ObfuscationModulePass());
+                return true;
+              }
+              if (Name == "obf-strip-key") {
+                MPM.addPass(obf::StripStringKeyPass());
                 return true;
               }
-              return false;
+              // obf, obf<bogus=N;nops=N;strings=N;flatten;parts=N;threads=N>
+              StringRef Params;
+              if (!parsePassName(Name, "obf", Params))
+                return false;
+              std::optional<obf::ObfuscationOptions> Opts = parseOptions(Params);
+              if (!Opts)
+                return false;
+              addObfuscationPasses(MPM, *Opts);
+              return true;
+            });
+        // Function pipelines only get the per-function transforms.
+        PB.registerPipelineParsingCallback(
+            [](StringRef Name, FunctionPassManager &FPM,
+               ArrayRef<PassBuilder::PipelineElement>) {
+              StringRef Params;
+              if (!parsePassName(Name, "obf-function", Params))
+                return false;
+              std::optional<obf::ObfuscationOptions> Opts = parseOptions(Params);
+              if (!Opts)
+                return false;
+              FPM.addPass(obf::ObfuscationFunctionPass(*Opts));
+              return true;
             });
       }};
 }
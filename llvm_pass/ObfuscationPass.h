@@ -1,22 +1,420 @@
 #ifndef OBFUSCATION_PASS_H
 #define OBFUSCATION_PASS_H
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/Support/Error.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <random>
 
 using namespace llvm;
 
+namespace llvm {
+class BlockFrequencyInfo;
+class LoopInfo;
+class OptimizationRemarkEmitter;
+class ProfileSummaryInfo;
+class TargetTransformInfo;
+}
+
 namespace obf {
+struct ObfuscationPolicy;
+
 struct ObfuscationOptions {
   unsigned bogusBlocksPerFunction = 1;
   unsigned stringEncryptLevel = 1;
   unsigned insertNops = 0;
   bool enableFlatten = false;
+  // Parallel mode: split the module into this many partitions (0/1 = off)
+  // and obfuscate them on up to `threads` threads (0 = all cores). The
+  // output depends only on the partition count, never on the thread count.
+  unsigned partitions = 0;
+  unsigned threads = 0;
+  // Directory of the obfuscated-function cache; empty disables it.
+  std::string cacheDir;
+  // Cap on a function's total growth over all cycles, as a percentage of
+  // its size before the first one (0 = no cap).
+  unsigned maxGrowth = 0;
+  // Module seed every random choice derives from (see makeRNG).
+  uint64_t seed = 0;
+  // Scope: with selectedOnly, only functions an annotation or a policy rule
+  // selects are obfuscated; the policy file (loaded when the options are
+  // parsed) selects functions and sets their levels.
+  bool selectedOnly = false;
+  std::string policyFile;
+  std::shared_ptr<const ObfuscationPolicy> policy;
+  // Hotness: the heavy transforms stay out of hot blocks. A profile
+  // (instrumented .profdata or a sample profile, loaded ahead of the pass)
+  // decides through ProfileSummaryInfo; without one, hotRatio (0 = off)
+  // marks blocks BFI expects to run at least that often per call.
+  std::string profileFile;
+  bool profileIsSample = false;
+  unsigned hotRatio = 0;
+  // Run-time budget: the transforms add at most this percentage of a
+  // function's estimated cost (see CostBudget; 0 = no budget).
+  unsigned costBudget = 0;
+  // Let bogus blocks go into loop bodies too (see findColdSites).
+  bool bogusInLoops = false;
+  // Move the filler of bogus blocks into cold functions in .text.unlikely.
+  bool outlineBogus = false;
+  // Decrypt each string on its first use instead of in a constructor.
+  bool lazyStrings = false;
+  // Decrypt strings only cold code uses into a stack buffer at each use,
+  // wiped right after it (see findColdBlocks).
+  bool stackStrings = false;
+  // Fork-friendly strings: the blob gets pages of its own, made read-only
+  // once decrypted, and nothing is decrypted on first use.
+  bool cowStrings = false;
+};
+
+// What the per-function transforms did to one function. Reported through
+// the "obfuscation" STATISTICs and a FunctionObfuscated optimization remark.
+struct ObfuscationStats {
+  unsigned bogusBlocks = 0;
+  unsigned nops = 0;
+  unsigned fakeLoops = 0;
+  unsigned instsBefore = 0;
+  unsigned instsAfter = 0;
+  unsigned blocksBefore = 0;
+  unsigned blocksAfter = 0;
+  unsigned hotBlocks = 0;
+  // Opaque predicates by tier (see PredicateTier) and their summed TTI
+  // latency.
+  unsigned aluPredicates = 0;
+  unsigned algebraicPredicates = 0;
+  unsigned statePredicates = 0;
+  unsigned predicateLatency = 0;
+  // Share of the cost budget used over all cycles, in percent.
+  unsigned budgetUsed = 0;
+  bool fromCache = false;
+  bool growthCapped = false;
+  bool budgetExhausted = false;
+};
+
+// Per-function stats by function name, in module order.
+using FunctionStatsList = std::vector<std::pair<std::string, ObfuscationStats>>;
+
+// Parses the parameter list of the `obf<...>` pipeline element, e.g.
+// "bogus=3;nops=8;strings=2;flatten;max-growth=300". Unknown keys are an
+// error.
+Expected<ObfuscationOptions> parseObfuscationOptions(StringRef Params);
+
+// Returns the options for F: the module-wide Defaults overridden by the
+// "obf-bogus", "obf-nops", "obf-strings" and "obf-flatten" function
+// attributes.
+ObfuscationOptions getFunctionOptions(const Function &F,
+                                      const ObfuscationOptions &Defaults);
+
+// True if F carries the "no-obf" attribute and must be left untouched.
+bool isObfuscationDisabled(const Function &F);
+
+// Everything the transforms insert (instructions, globals, functions) carries
+// !obf metadata naming the transform, so later cycles never work on their
+// own output. A transformed function records its original size in
+// !obf.size, which the max-growth cap is measured against.
+void tagObfuscation(Instruction &I, StringRef Kind);
+void tagObfuscation(GlobalObject &GO, StringRef Kind);
+bool isObfuscation(const Instruction &I);
+bool isObfuscation(const GlobalObject &GO);
+
+// Reads a policy file (YAML, or JSON as its subset):
+//
+//   selected-only: true
+//   functions:
+//     - { name: main, bogus: 3, nops: 8 }
+//     - { regex: '^check_', flatten: true, strings: 2 }
+//     - { section: .text.secure }
+//     - { name: sum, skip: true }
+//
+// Rules match the (mangled or demangled) name exactly, a regex against
+// either, or the function's section; the first match wins.
+Expected<std::shared_ptr<const ObfuscationPolicy>>
+loadObfuscationPolicy(StringRef Path);
+
+// Turns annotate("obf"), annotate("obf=bogus=2;nops=4;strings=2;flatten")
+// and annotate("no-obf") from llvm.global.annotations, and the rules of
+// Opts.policy, into the "obf", "no-obf" and obf-* function attributes;
+// annotation levels override the policy's, and "no-obf" from any source
+// wins. With selectedOnly (or the policy's selected-only) every definition
+// left without "obf" gets "no-obf". Safe to run every cycle; returns true
+// if it changed an attribute.
+bool applyObfuscationScope(Module &M, const ObfuscationOptions &Opts);
+
+// Blocks of one function that must not receive inserted code.
+using HotBlockSet = SmallPtrSet<const BasicBlock *, 16>;
+
+// True if the profile at Path is a sample (AutoFDO/perf) profile rather
+// than an indexed instrumentation profile.
+Expected<bool> isSampleProfile(StringRef Path);
+
+// Adds the loader for Opts.profileFile (PGOInstrumentationUse or
+// SampleProfileLoaderPass) and caches ProfileSummaryAnalysis for the
+// function passes after it. Does nothing without a profile.
+void addProfileLoader(ModulePassManager &MPM, const ObfuscationOptions &Opts);
+
+// F's hot blocks: PSI->isHotBlock with a profile summary, else blocks that
+// BFI estimates to run at least Opts.hotRatio times per call and more often
+// than the entry, which is thus never hot. Empty when neither applies. PSI
+// may be null; it is then built from M's summary if there is one.
+HotBlockSet findHotBlocks(Function &F, const ObfuscationOptions &Opts,
+                          FunctionAnalysisManager &FAM,
+                          ProfileSummaryInfo *PSI);
+
+// What the hotness decisions for M depend on, for the function cache key.
+std::string describeHotness(const Module &M, const ObfuscationOptions &Opts);
+
+// Split points for bogus blocks in F, at most one per block, coldest first:
+// blocks that can only end in unreachable or a noreturn call, then
+// exception-handling blocks and blocks calling cold functions, then the
+// rest by block frequency. Hot blocks are left out, and so are loop bodies
+// unless AllowLoops.
+SmallVector<Instruction *, 8> findColdSites(Function &F,
+                                            const HotBlockSet &Hot,
+                                            const LoopInfo *LI,
+                                            const BlockFrequencyInfo &BFI,
+                                            bool AllowLoops);
+
+// Blocks of F that rarely run: all of them if F is cold, blocks that can
+// only end in unreachable or a noreturn call, exception-handling blocks and
+// blocks calling cold functions, and, given a profile summary, the blocks
+// PSI finds cold.
+SmallPtrSet<const BasicBlock *, 8> findColdBlocks(Function &F,
+                                                  ProfileSummaryInfo *PSI);
+
+// The run-time cost budget of one function. Costs are TTI latencies weighted
+// by the frequency of the block they run in relative to the entry, kept in
+// thousandths of a cycle per call. The function's original cost and what
+// the budget has spent persist in !obf.cost, so one budget covers all
+// cycles the way max-growth does.
+class CostBudget {
+  Function &F;
+  const TargetTransformInfo &TTI;
+  BlockFrequencyInfo &BFI;
+  uint64_t EntryFreq;
+  uint64_t Original = 0, Used = 0, Limit = 0;
+  // Blocks split off this cycle, which BFI does not know yet.
+  DenseMap<const BasicBlock *, double> Weights;
+
+  double weight(const BasicBlock &BB) const;
+  uint64_t weigh(const BasicBlock &BB, uint64_t Cost) const;
+
+public:
+  CostBudget(Function &F, unsigned Percent, const TargetTransformInfo &TTI,
+             BlockFrequencyInfo &BFI);
+
+  // Charges Cost (TTI units per execution) run in BB; false, charging
+  // nothing, if it does not fit.
+  bool spend(const BasicBlock &BB, uint64_t Cost);
+  // New holds code split off From and runs as often.
+  void inherit(const BasicBlock &New, const BasicBlock &From);
+  unsigned percentUsed() const;
+  // Records the spending in !obf.cost for the next cycle.
+  void save();
+
+  // Per-execution costs of what the transforms insert on executed paths:
+  // a NOP and one pass through the fake loop. Bogus blocks are charged the
+  // latency of the predicate they actually emit, plus its branch.
+  uint64_t nopCost() const;
+  uint64_t fakeLoopCost() const;
+};
+
+// TTI's latency for I and for a branch, the cost units of CostBudget.
+uint64_t getLatency(const TargetTransformInfo &TTI, const Instruction &I);
+uint64_t getBranchLatency(const TargetTransformInfo &TTI);
+
+// The latencies TTI gives the transforms in F: those of F's instructions,
+// which bogus fillers copy, and of the integer operations, compares and
+// branches that predicates, NOPs and fake loops are made of.
+std::string describeLatencies(const TargetTransformInfo &TTI,
+                              const Function &F);
+
+// Opaque predicates in cost tiers, cheapest first: the square of a live
+// integer, the product of two consecutive ones, and a volatile load of
+// global state only the pass knows never changes. None of them is one
+// InstCombine or known-bits analysis can fold.
+enum class PredicateTier { Alu, Algebraic, GlobalState };
+
+StringRef getPredicateTierName(PredicateTier T);
+
+// The tier for a site that runs Weight times per call (block frequency
+// relative to the entry): the hotter the site, the cheaper the predicate.
+PredicateTier choosePredicateTier(double Weight);
+
+struct OpaquePredicate {
+  Value *Cond = nullptr;
+  PredicateTier Tier;
+  // What was emitted, in order, all tagged "bogus".
+  SmallVector<Instruction *, 8> Insts;
+};
+
+// Emits an i1 that is always false, of tier Tier, at B's insertion point.
+// Live is an integer available there (or null); without one of at least 8
+// bits the GlobalState tier is used. Seed picks the module's state words.
+OpaquePredicate createOpaquePredicate(IRBuilder<> &B, PredicateTier Tier,
+                                      Value *Live, uint64_t Seed,
+                                      std::mt19937_64 &RNG);
+
+// The global named Name that the transforms create on first use (the
+// GlobalState tier's state words), created in M if it is missing yet; null
+// for any other name.
+GlobalVariable *getOwnedGlobal(Module &M, StringRef Name, uint64_t Seed);
+
+// Splits M into Parts partitions (SplitModule, locals kept together), hands
+// each one to Fn in its own LLVMContext on a pool of Threads threads, and
+// links the results back into M in partition order. Fn gets the partition
+// index and must only touch state owned by that partition.
+void runPartitioned(Module &M, unsigned Parts, unsigned Threads,
+                    function_ref<void(Module &, unsigned)> Fn);
+
+// On-disk cache of obfuscated function bodies. Entries are keyed by a hash
+// of the function's pre-obfuscation bitcode (with declarations of whatever
+// it references, the triple and the data layout), of the target CPU and
+// features and the latencies TTI gives for them, and of the options that
+// shape the per-function transforms. Safe to share between threads.
+class FunctionCache {
+  std::string Dir;
+
+public:
+  explicit FunctionCache(StringRef Dir) : Dir(Dir.str()) {}
+
+  // The cache key for F, or nullopt if F cannot be cached (debug info,
+  // unnamed, references another function's blocks, or its bogus blocks
+  // are outlined). TTI is the one the transforms will cost F with, if any.
+  std::optional<std::string> key(const Function &F,
+                                 const ObfuscationOptions &FnOpts,
+                                 const TargetTransformInfo *TTI) const;
+  // Replaces F's body with the cached one and restores S; false on a miss.
+  // Globals the body needs that the transforms create on first use are
+  // created in F's module if it has none yet.
+  bool restore(Function &F, StringRef Key, const ObfuscationOptions &FnOpts,
+               ObfuscationStats &S) const;
+  // Records F's (obfuscated) body and S under Key.
+  void store(const Function &F, StringRef Key,
+             const ObfuscationStats &S) const;
+};
+
+// Bogus blocks, NOP padding and the fake loop for a single function. Takes
+// DominatorTree/LoopInfo (and, with a cost budget, TTI and BFI) from the
+// FunctionAnalysisManager, keeps the former up to date and reports them
+// preserved unless a transform could not. Each transform is a -time-trace
+// scope; with RegionTimers it also feeds the "Obfuscation transforms"
+// -time-passes group (main thread only).
+class ObfuscationFunctionPass
+    : public PassInfoMixin<ObfuscationFunctionPass> {
+  ObfuscationOptions Options;
+  bool RegionTimers;
+
+public:
+  explicit ObfuscationFunctionPass(const ObfuscationOptions &Opts,
+                                   bool RegionTimers = true)
+      : Options(Opts), RegionTimers(RegionTimers) {}
+  PreservedAnalyses run(Function &F, FunctionAnalysisManager &FAM);
+};
+
+// Module-level string encryption; reports a StringsEncrypted remark on the
+// decryption constructor.
+class StringObfuscationPass : public PassInfoMixin<StringObfuscationPass> {
+  ObfuscationOptions Options;
+
+public:
+  explicit StringObfuscationPass(const ObfuscationOptions &Opts)
+      : Options(Opts) {}
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
 };
+
+// stripStringKey as a pipeline element, obf-strip-key.
+class StripStringKeyPass : public PassInfoMixin<StripStringKeyPass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+// applyObfuscationScope as the first pass of obf<...>.
+class ObfuscationScopePass : public PassInfoMixin<ObfuscationScopePass> {
+  ObfuscationOptions Options;
+
+public:
+  explicit ObfuscationScopePass(const ObfuscationOptions &Opts)
+      : Options(Opts) {}
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+// Whole-module driver for the partitioned mode and obf-legacy. Without
+// options it reads them from the obf_* globals of the module.
+class ObfuscationModulePass : public PassInfoMixin<ObfuscationModulePass> {
+  std::optional<ObfuscationOptions> Options;
+
+public:
+  ObfuscationModulePass() = default;
+  explicit ObfuscationModulePass(const ObfuscationOptions &Opts)
+      : Options(Opts) {}
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM);
+};
+
+// Obfuscates one function (honouring its attributes, the cache and the
+// growth cap), fills S and emits its remark. Does nothing for declarations,
+// intrinsics, generated and "no-obf" functions. PSI is the module's profile
+// summary, if the caller has one (see findHotBlocks).
+PreservedAnalyses obfuscateFunction(Function &F, const ObfuscationOptions &Opts,
+                                    FunctionAnalysisManager &FAM,
+                                    ProfileSummaryInfo *PSI, bool RegionTimers,
+                                    ObfuscationStats &S);
+
+// A generator for the random choices made for one object, seeded from the
+// module seed, its name and Salt. Choices thus depend neither on the order
+// objects are visited in nor on the thread count. Only raw engine output is
+// used, since the std distributions differ between standard libraries.
+std::mt19937_64 makeRNG(uint64_t Seed, StringRef Name, uint64_t Salt = 0);
+
+// Encrypts the str.* C strings of M into one blob, __obf_strings, and emits
+// __obf_init to decrypt it at startup. Each later call adds a layer to the
+// blob, appends the new strings and rebuilds __obf_init in place, so one
+// pass still decrypts every layer. With stackStrings, strings only
+// passed to calls in cold blocks are decrypted onto the stack at each call
+// instead; with lazyStrings, other strings that only instructions use are
+// decrypted on first use. Those get a key each. With cowStrings the blob
+// fills pages of its own and turns read-only once decrypted.
+//
+// A string's level is the highest "obf-strings" level among the obfuscated
+// functions using it (see getFunctionOptions); strings only "no-obf"
+// functions use stay plaintext.
+//
+// A later cycle replaces the blob and its constructor even when it finds no
+// new strings, so Changed can be set with Strings at 0. The old constructor
+// is erased; pass FAM to have its cached analyses dropped first.
+struct StringObfuscationResult {
+  unsigned Strings = 0;
+  bool Changed = false;
+};
+StringObfuscationResult
+runStringObfuscation(Module &M, const ObfuscationOptions &Opts,
+                     FunctionAnalysisManager *FAM = nullptr);
+
+// Drops the summed key runStringObfuscation keeps on the blob for later
+// cycles, so it does not reach the output. Run it after the last cycle; a
+// call after that starts a blob and constructor of its own. Returns whether
+// there was a key to drop.
+bool stripStringKey(Module &M);
+
+// Runs ObfuscationFunctionPass over every function of M with a private
+// FunctionAnalysisManager, for callers outside a new-PM pipeline. Its TTI
+// comes from a TargetMachine for M's triple, as in a pipeline for M, so
+// partitions make the same cost decisions. Returns the stats of every
+// function it visited.
+FunctionStatsList obfuscateFunctions(Module &M, const ObfuscationOptions &Opts,
+                                     bool RegionTimers = true);
+
+// Emits the FunctionObfuscated remark for F, with one argument per counter.
+void emitFunctionRemark(OptimizationRemarkEmitter &ORE, const Function &F,
+                        const ObfuscationStats &S);
 }
 
 #endif
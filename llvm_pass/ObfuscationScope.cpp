@@ -0,0 +1,223 @@
+#include "ObfuscationPass.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Demangle/Demangle.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/YAMLTraits.h"
+
+using namespace llvm;
+
+namespace {
+// What an annotation or a policy rule sets for a function; unset levels
+// keep the module-wide option.
+struct FunctionLevels {
+  std::optional<unsigned> Bogus, Nops, Strings;
+  std::optional<bool> Flatten;
+};
+
+struct PolicyRule {
+  std::string Name, Pattern, Section;
+  bool Skip = false;
+  FunctionLevels Levels;
+  std::optional<Regex> Re;
+};
+} // namespace
+
+struct obf::ObfuscationPolicy {
+  bool SelectedOnly = true;
+  std::vector<PolicyRule> Rules;
+};
+
+LLVM_YAML_IS_SEQUENCE_VECTOR(PolicyRule)
+
+namespace llvm {
+namespace yaml {
+template <> struct MappingTraits<PolicyRule> {
+  static void mapping(IO &IO, PolicyRule &R) {
+    IO.mapOptional("name", R.Name);
+    IO.mapOptional("regex", R.Pattern);
+    IO.mapOptional("section", R.Section);
+    IO.mapOptional("skip", R.Skip, false);
+    IO.mapOptional("bogus", R.Levels.Bogus);
+    IO.mapOptional("nops", R.Levels.Nops);
+    IO.mapOptional("strings", R.Levels.Strings);
+    IO.mapOptional("flatten", R.Levels.Flatten);
+  }
+  static std::string validate(IO &, PolicyRule &R) {
+    if (R.Name.empty() + R.Pattern.empty() + R.Section.empty() != 2)
+      return "each rule needs exactly one of name, regex and section";
+    return "";
+  }
+};
+
+template <> struct MappingTraits<obf::ObfuscationPolicy> {
+  static void mapping(IO &IO, obf::ObfuscationPolicy &P) {
+    IO.mapOptional("selected-only", P.SelectedOnly, true);
+    IO.mapOptional("functions", P.Rules);
+  }
+};
+} // namespace yaml
+} // namespace llvm
+
+Expected<std::shared_ptr<const obf::ObfuscationPolicy>>
+obf::loadObfuscationPolicy(StringRef Path) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile(Path);
+  if (!Buf)
+    return createFileError(Path, Buf.getError());
+  auto Policy = std::make_shared<ObfuscationPolicy>();
+  yaml::Input In((*Buf)->getBuffer());
+  In >> *Policy;
+  if (In.error())
+    return createStringError(In.error(), "invalid obf policy '%s'",
+                             Path.str().c_str());
+  for (PolicyRule &R : Policy->Rules) {
+    if (R.Pattern.empty())
+      continue;
+    std::string Error;
+    R.Re.emplace(R.Pattern);
+    if (!R.Re->isValid(Error))
+      return createStringError(inconvertibleErrorCode(),
+                               "invalid regex '%s' in obf policy '%s': %s",
+                               R.Pattern.c_str(), Path.str().c_str(),
+                               Error.c_str());
+  }
+  return Policy;
+}
+
+static const PolicyRule *findRule(const obf::ObfuscationPolicy &P,
+                                  const Function &F) {
+  std::optional<std::string> Demangled;
+  auto DemangledName = [&]() -> StringRef {
+    if (!Demangled)
+      Demangled = demangle(F.getName().str());
+    return *Demangled;
+  };
+  for (const PolicyRule &R : P.Rules) {
+    bool Match;
+    if (!R.Name.empty())
+      Match = F.getName() == R.Name || DemangledName() == R.Name;
+    else if (R.Re)
+      Match = R.Re->match(F.getName()) || R.Re->match(DemangledName());
+    else
+      Match = F.getSection() == R.Section;
+    if (Match)
+      return &R;
+  }
+  return nullptr;
+}
+
+// Parses the parameters of annotate("obf=..."); unknown ones are reported
+// and ignored, like a typo in a source attribute should be.
+static FunctionLevels parseAnnotation(const Function &F, StringRef Params) {
+  FunctionLevels L;
+  while (!Params.empty()) {
+    StringRef Param;
+    std::tie(Param, Params) = Params.split(';');
+    Param = Param.trim();
+    if (Param == "flatten" || Param == "no-flatten") {
+      L.Flatten = Param == "flatten";
+      continue;
+    }
+    StringRef Key, Value;
+    std::tie(Key, Value) = Param.split('=');
+    unsigned N;
+    std::optional<unsigned> *Level = Key == "bogus"     ? &L.Bogus
+                                     : Key == "nops"    ? &L.Nops
+                                     : Key == "strings" ? &L.Strings
+                                                        : nullptr;
+    if (!Level || Value.getAsInteger(0, N)) {
+      errs() << formatv("obf: ignoring annotation parameter '{0}' on {1}\n",
+                        Param, F.getName());
+      continue;
+    }
+    *Level = N;
+  }
+  return L;
+}
+
+// Marks F selected with levels L. An explicit "no-obf" always wins.
+static bool select(Function &F, const FunctionLevels &L) {
+  bool Changed = !F.hasFnAttribute("obf");
+  F.addFnAttr("obf");
+  auto Set = [&](StringRef Kind, std::string Value) {
+    Changed |= F.getFnAttribute(Kind).getValueAsString() != Value;
+    F.addFnAttr(Kind, Value);
+  };
+  if (L.Bogus)
+    Set("obf-bogus", utostr(*L.Bogus));
+  if (L.Nops)
+    Set("obf-nops", utostr(*L.Nops));
+  if (L.Strings)
+    Set("obf-strings", utostr(*L.Strings));
+  if (L.Flatten)
+    Set("obf-flatten", *L.Flatten ? "true" : "false");
+  return Changed;
+}
+
+static bool skip(Function &F) {
+  if (F.hasFnAttribute("no-obf"))
+    return false;
+  F.addFnAttr("no-obf");
+  return true;
+}
+
+// Entries of llvm.global.annotations: { ptr value, ptr string, ptr file,
+// i32 line, ptr args }.
+static bool applyAnnotations(Module &M) {
+  GlobalVariable *GA = M.getGlobalVariable("llvm.global.annotations");
+  if (!GA || !GA->hasInitializer())
+    return false;
+  auto *Entries = dyn_cast<ConstantArray>(GA->getInitializer());
+  if (!Entries)
+    return false;
+  bool Changed = false;
+  for (const Use &U : Entries->operands()) {
+    auto *Entry = dyn_cast<ConstantStruct>(U.get());
+    if (!Entry || Entry->getNumOperands() < 2)
+      continue;
+    auto *F = dyn_cast<Function>(Entry->getOperand(0)->stripPointerCasts());
+    auto *Str =
+        dyn_cast<GlobalVariable>(Entry->getOperand(1)->stripPointerCasts());
+    if (!F || !Str || !Str->hasInitializer())
+      continue;
+    auto *Data = dyn_cast<ConstantDataArray>(Str->getInitializer());
+    if (!Data || !Data->isCString())
+      continue;
+    StringRef A = Data->getAsCString();
+    if (A == "no-obf") {
+      Changed |= skip(*F);
+      continue;
+    }
+    if (!A.consume_front("obf") || (!A.empty() && !A.consume_front("=")))
+      continue;
+    Changed |= select(*F, parseAnnotation(*F, A));
+  }
+  return Changed;
+}
+
+bool obf::applyObfuscationScope(Module &M, const ObfuscationOptions &Opts) {
+  bool Changed = false;
+  if (Opts.policy)
+    for (Function &F : M) {
+      if (F.isDeclaration() || isObfuscation(F))
+        continue;
+      if (const PolicyRule *R = findRule(*Opts.policy, F))
+        Changed |= R->Skip ? skip(F) : select(F, R->Levels);
+    }
+  Changed |= applyAnnotations(M);
+
+  if (Opts.selectedOnly || (Opts.policy && Opts.policy->SelectedOnly))
+    for (Function &F : M)
+      if (!F.isDeclaration() && !isObfuscation(F) && !F.hasFnAttribute("obf"))
+        Changed |= skip(F);
+  return Changed;
+}
+
+PreservedAnalyses obf::ObfuscationScopePass::run(Module &M,
+                                                 ModuleAnalysisManager &) {
+  // Only string attributes change, which no analysis looks at.
+  applyObfuscationScope(M, Options);
+  return PreservedAnalyses::all();
+}
@@ -0,0 +1,116 @@
+#include "ObfuscationPass.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+
+using namespace llvm;
+
+StringRef obf::getPredicateTierName(PredicateTier T) {
+  switch (T) {
+  case PredicateTier::Alu:
+    return "alu";
+  case PredicateTier::Algebraic:
+    return "algebraic";
+  case PredicateTier::GlobalState:
+    return "state";
+  }
+  llvm_unreachable("unknown predicate tier");
+}
+
+obf::PredicateTier obf::choosePredicateTier(double Weight) {
+  if (Weight <= 0.125)
+    return PredicateTier::GlobalState;
+  if (Weight <= 1)
+    return PredicateTier::Algebraic;
+  return PredicateTier::Alu;
+}
+
+static constexpr StringLiteral OpaqueStateName = "__obf_opaque_state";
+
+// Two odd words the predicates of every module index into; the pass never
+// writes them and volatile loads keep the optimizer from finding out. The
+// definition is hidden weak_odr, so every translation unit (and every
+// obf-lazy part) may carry one, and the seed picks the same contents.
+static GlobalVariable *getOpaqueState(Module &M, uint64_t Seed) {
+  StringRef Name = OpaqueStateName;
+  if (GlobalVariable *GV = M.getGlobalVariable(Name, /*AllowInternal=*/true))
+    return GV;
+  LLVMContext &C = M.getContext();
+  std::mt19937_64 RNG = obf::makeRNG(Seed, Name);
+  Constant *Words[] = {ConstantInt::get(Type::getInt32Ty(C), RNG() | 1),
+                       ConstantInt::get(Type::getInt32Ty(C), RNG() | 1)};
+  ArrayType *Ty = ArrayType::get(Type::getInt32Ty(C), 2);
+  auto *GV = new GlobalVariable(M, Ty, /*isConstant=*/false,
+                                GlobalValue::WeakODRLinkage,
+                                ConstantArray::get(Ty, Words), Name);
+  GV->setVisibility(GlobalValue::HiddenVisibility);
+  obf::tagObfuscation(*GV, "bogus");
+  return GV;
+}
+
+GlobalVariable *obf::getOwnedGlobal(Module &M, StringRef Name,
+                                    uint64_t Seed) {
+  return Name == OpaqueStateName ? getOpaqueState(M, Seed) : nullptr;
+}
+
+obf::OpaquePredicate obf::createOpaquePredicate(IRBuilder<> &B,
+                                                PredicateTier Tier,
+                                                Value *Live, uint64_t Seed,
+                                                std::mt19937_64 &RNG) {
+  OpaquePredicate P;
+  auto Track = [&](Value *V) {
+    if (auto *I = dyn_cast<Instruction>(V)) {
+      obf::tagObfuscation(*I, "bogus");
+      P.Insts.push_back(I);
+    }
+    return V;
+  };
+  IntegerType *Ty =
+      Live ? dyn_cast<IntegerType>(Live->getType()) : (IntegerType *)nullptr;
+  if (!Ty || Ty->getBitWidth() < 8)
+    Tier = PredicateTier::GlobalState;
+  P.Tier = Tier;
+  // An unused argument may be passed poison; branching on it would be UB.
+  if (Ty)
+    Live = Track(B.CreateFreeze(Live));
+
+  switch (Tier) {
+  case PredicateTier::Alu: {
+    // A square is 0, 1 or 4 modulo 8, also modulo 2^n, so it never equals
+    // a K of 5 modulo 8: one multiply next to the compare. Known bits only
+    // see that bit 1 of a square is clear, which K leaves alone.
+    uint64_t K = (RNG() << 3 | 5) & Ty->getBitMask();
+    Value *Sq = Track(B.CreateMul(Live, Live));
+    P.Cond = Track(B.CreateICmpEQ(Sq, ConstantInt::get(Ty, K)));
+    break;
+  }
+  case PredicateTier::Algebraic: {
+    // Of two consecutive integers one is even, so x * (x + 1) and
+    // x * (x - 1) are too; known bits do not relate the two factors.
+    Value *Next = Track(
+        B.CreateAdd(Live, ConstantInt::get(Ty, RNG() & 1 ? 1 : -1, true)));
+    Value *Prod = Track(B.CreateMul(Live, Next));
+    Value *Low = Track(B.CreateAnd(Prod, ConstantInt::get(Ty, 1)));
+    P.Cond = Track(B.CreateICmpNE(Low, ConstantInt::get(Ty, 0)));
+    break;
+  }
+  case PredicateTier::GlobalState: {
+    // Both words are odd, so whichever one the live value selects, its low
+    // bit is set; a pointer analysis cannot tell which one is read.
+    Module &M = *B.GetInsertBlock()->getModule();
+    GlobalVariable *State = getOpaqueState(M, Seed);
+    Type *I32 = Type::getInt32Ty(M.getContext());
+    Value *Index = ConstantInt::get(I32, 0);
+    if (Ty)
+      Index = Track(B.CreateAnd(Track(B.CreateZExtOrTrunc(Live, I32)),
+                                ConstantInt::get(I32, 1)));
+    Value *Ptr = Track(B.CreateInBoundsGEP(
+        State->getValueType(), State, {ConstantInt::get(I32, 0), Index}));
+    LoadInst *Word = B.CreateLoad(I32, Ptr, /*isVolatile=*/true);
+    Track(Word);
+    Value *Low = Track(B.CreateAnd(Word, ConstantInt::get(I32, 1)));
+    P.Cond = Track(B.CreateICmpEQ(Low, ConstantInt::get(I32, 0)));
+    break;
+  }
+  }
+  return P;
+}
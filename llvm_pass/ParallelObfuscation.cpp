@@ -0,0 +1,160 @@
+#include "ObfuscationPass.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/DebugInfo.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include <vector>
+
+using namespace llvm;
+
+// Removes every global value and every named metadata node except the module
+// flags, so the linked partitions can take their place without renaming.
+static void clearModule(Module &M) {
+  for (Function &F : M)
+    F.dropAllReferences();
+  for (GlobalVariable &GV : M.globals())
+    GV.dropAllReferences();
+  for (GlobalAlias &GA : M.aliases())
+    GA.dropAllReferences();
+  for (GlobalIFunc &GI : M.ifuncs())
+    GI.dropAllReferences();
+  for (GlobalValue &GV : make_early_inc_range(M.global_values())) {
+    GV.removeDeadConstantUsers();
+    GV.eraseFromParent();
+  }
+  for (NamedMDNode &NMD : make_early_inc_range(M.named_metadata()))
+    if (NMD.getName() != "llvm.module.flags")
+      M.eraseNamedMetadata(&NMD);
+  M.getComdatSymbolTable().clear();
+}
+
+// Every partition carries a copy of each compile unit, and the verifier
+// wants each one its subprograms use listed in !llvm.dbg.cu, so the copies
+// can only be merged after linking: subprograms move to the first copy of
+// their unit, which takes over the variables attached to globals in M, and
+// the other copies leave !llvm.dbg.cu.
+static void mergeCompileUnits(Module &M) {
+  NamedMDNode *CUs = M.getNamedMetadata("llvm.dbg.cu");
+  if (!CUs)
+    return;
+  std::map<std::tuple<Metadata *, StringRef, unsigned>, DICompileUnit *> Keys;
+  DenseMap<DICompileUnit *, DICompileUnit *> Leader;
+  SmallVector<DICompileUnit *, 4> Leaders;
+  for (MDNode *N : CUs->operands()) {
+    auto *CU = cast<DICompileUnit>(N);
+    auto [It, New] = Keys.try_emplace(
+        {CU->getRawFile(), CU->getProducer(), CU->getSourceLanguage()}, CU);
+    Leader[CU] = It->second;
+    if (New)
+      Leaders.push_back(CU);
+  }
+  if (Leaders.size() == CUs->getNumOperands())
+    return;
+
+  DebugInfoFinder Finder;
+  Finder.processModule(M);
+  for (DISubprogram *SP : Finder.subprograms())
+    if (DICompileUnit *CU = SP->getUnit(); CU && Leader.count(CU))
+      SP->replaceUnit(Leader[CU]);
+
+  // A copy's variable is the one to keep if a global in M still has it;
+  // the leader also keeps those of globals that were optimized away.
+  SmallPtrSet<Metadata *, 32> Attached;
+  for (GlobalVariable &GV : M.globals()) {
+    SmallVector<DIGlobalVariableExpression *, 1> GVEs;
+    GV.getDebugInfo(GVEs);
+    Attached.insert(GVEs.begin(), GVEs.end());
+  }
+  DenseMap<DICompileUnit *, SmallSetVector<Metadata *, 16>> Globals;
+  for (MDNode *N : CUs->operands()) {
+    auto *CU = cast<DICompileUnit>(N);
+    for (DIGlobalVariableExpression *GVE : CU->getGlobalVariables())
+      if (Attached.count(GVE) || Leader[CU] == CU)
+        Globals[Leader[CU]].insert(GVE);
+  }
+  CUs->clearOperands();
+  for (DICompileUnit *CU : Leaders) {
+    CU->replaceGlobalVariables(
+        MDTuple::get(M.getContext(), Globals[CU].getArrayRef()));
+    CUs->addOperand(CU);
+  }
+}
+
+// Runs Fn on the partition in Buf in a fresh context and replaces Buf with
+// the result.
+static void obfuscatePartition(SmallString<0> &Buf, unsigned I,
+                               function_ref<void(Module &, unsigned)> Fn) {
+  TimeTraceScope Scope("ObfuscatePartition", Twine(I).str());
+  LLVMContext Ctx;
+  Expected<std::unique_ptr<Module>> MPart =
+      parseBitcodeFile(MemoryBufferRef(Buf, "obf-partition"), Ctx);
+  if (!MPart)
+    report_fatal_error(MPart.takeError());
+  Fn(**MPart, I);
+  Buf.clear();
+  raw_svector_ostream OS(Buf);
+  WriteBitcodeToFile(**MPart, OS);
+}
+
+void obf::runPartitioned(Module &M, unsigned Parts, unsigned Threads,
+                         function_ref<void(Module &, unsigned)> Fn) {
+  // Partitions travel between contexts as bitcode.
+  std::vector<SmallString<0>> Buffers;
+  Buffers.reserve(Parts);
+  timeTraceProfilerBegin("SplitModule", M.getName());
+  SplitModule(
+      M, Parts,
+      [&](std::unique_ptr<Module> MPart) {
+        // Module asm is copied into every partition; M keeps the only copy.
+        MPart->setModuleInlineAsm("");
+        // So are the named metadata (!llvm.ident, dependent libraries); the
+        // linker would append every copy. Only the first partition keeps
+        // them, but the compile units in each are merged after linking.
+        if (!Buffers.empty())
+          for (NamedMDNode &NMD : make_early_inc_range(MPart->named_metadata()))
+            if (NMD.getName() != "llvm.module.flags" &&
+                NMD.getName() != "llvm.dbg.cu")
+              MPart->eraseNamedMetadata(&NMD);
+        raw_svector_ostream OS(Buffers.emplace_back());
+        WriteBitcodeToFile(*MPart, OS);
+      },
+      /*PreserveLocals=*/true);
+  timeTraceProfilerEnd();
+
+  // The time-trace profiler is per thread; workers get their own and hand
+  // it back to the main one when done.
+  bool Trace = timeTraceProfilerEnabled();
+  DefaultThreadPool Pool(hardware_concurrency(Threads));
+  for (unsigned I = 0; I < Buffers.size(); ++I) {
+    Pool.async([&, I] {
+      if (Trace)
+        timeTraceProfilerInitialize(/*TimeTraceGranularity=*/500,
+                                    "obf-partition");
+      obfuscatePartition(Buffers[I], I, Fn);
+      if (Trace)
+        timeTraceProfilerFinishThread();
+    });
+  }
+  Pool.wait();
+
+  // Link back in partition order so the result is independent of which
+  // thread finished first.
+  TimeTraceScope Scope("LinkPartitions", M.getName());
+  clearModule(M);
+  Linker L(M);
+  for (SmallString<0> &Buf : Buffers) {
+    Expected<std::unique_ptr<Module>> MPart =
+        parseBitcodeFile(MemoryBufferRef(Buf, "obf-partition"), M.getContext());
+    if (!MPart)
+      report_fatal_error(MPart.takeError());
+    if (L.linkInModule(std::move(*MPart)))
+      report_fatal_error("obf: failed to link obfuscated partition back");
+  }
+  mergeCompileUnits(M);
+}
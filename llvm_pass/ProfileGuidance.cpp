@@ -0,0 +1,98 @@
+#include "ObfuscationPass.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/ProfileData/InstrProfReader.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Transforms/IPO/SampleProfile.h"
+#include "llvm/Transforms/Instrumentation/PGOInstrumentation.h"
+
+using namespace llvm;
+
+Expected<bool> obf::isSampleProfile(StringRef Path) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buf = MemoryBuffer::getFile(Path);
+  if (!Buf)
+    return createFileError(Path, Buf.getError());
+  return !IndexedInstrProfReader::hasFormat(**Buf);
+}
+
+namespace {
+// The sample loader only reads profiles into functions that ask for it,
+// which clang marks under -fprofile-sample-use.
+class RequestSampleProfilePass
+    : public PassInfoMixin<RequestSampleProfilePass> {
+public:
+  PreservedAnalyses run(Module &M, ModuleAnalysisManager &) {
+    for (Function &F : M)
+      if (!F.isDeclaration())
+        F.addFnAttr("use-sample-profile");
+    return PreservedAnalyses::all();
+  }
+};
+} // namespace
+
+void obf::addProfileLoader(ModulePassManager &MPM,
+                           const ObfuscationOptions &Opts) {
+  if (Opts.profileFile.empty())
+    return;
+  if (Opts.profileIsSample) {
+    MPM.addPass(RequestSampleProfilePass());
+    MPM.addPass(SampleProfileLoaderPass(Opts.profileFile));
+  } else {
+    MPM.addPass(PGOInstrumentationUse(Opts.profileFile));
+  }
+  // Function passes may only use module analyses that are already cached.
+  MPM.addPass(RequireAnalysisPass<ProfileSummaryAnalysis, Module>());
+}
+
+// With a profile summary hotness is measured, otherwise it is hotRatio over
+// BFI's static estimate; neither means every block is fair game.
+static bool usesHotness(const Module &M, const obf::ObfuscationOptions &Opts) {
+  return Opts.hotRatio || M.getProfileSummary(/*IsCS=*/false);
+}
+
+std::string obf::describeHotness(const Module &M,
+                                 const ObfuscationOptions &Opts) {
+  if (!usesHotness(M, Opts))
+    return "";
+  if (!M.getProfileSummary(/*IsCS=*/false))
+    return formatv(";hot={0}", Opts.hotRatio).str();
+  ProfileSummaryInfo PSI(M);
+  return formatv(";hot-count={0};cold-count={1}",
+                 PSI.getOrCompHotCountThreshold(),
+                 PSI.getOrCompColdCountThreshold())
+      .str();
+}
+
+obf::HotBlockSet obf::findHotBlocks(Function &F,
+                                    const ObfuscationOptions &Opts,
+                                    FunctionAnalysisManager &FAM,
+                                    ProfileSummaryInfo *PSI) {
+  HotBlockSet Hot;
+  Module &M = *F.getParent();
+  if (!usesHotness(M, Opts))
+    return Hot;
+  BlockFrequencyInfo &BFI = FAM.getResult<BlockFrequencyAnalysis>(F);
+
+  std::optional<ProfileSummaryInfo> LocalPSI;
+  if (!PSI && M.getProfileSummary(/*IsCS=*/false)) {
+    // A pipeline that never required ProfileSummaryAnalysis.
+    LocalPSI.emplace(M);
+    PSI = &*LocalPSI;
+  }
+
+  // Everything runs at least once per call, so with hot=1 a plain ratio
+  // would make the entry (and all straight-line code) hot.
+  uint64_t EntryFreq = std::max<uint64_t>(
+      BFI.getBlockFreq(&F.getEntryBlock()).getFrequency(), 1);
+  for (BasicBlock &BB : F) {
+    uint64_t Freq = BFI.getBlockFreq(&BB).getFrequency();
+    bool IsHot = PSI && PSI->hasProfileSummary()
+                     ? PSI->isHotBlock(&BB, &BFI)
+                     : Freq > EntryFreq &&
+                           double(Freq) / EntryFreq >= Opts.hotRatio;
+    if (IsHot)
+      Hot.insert(&BB);
+  }
+  return Hot;
+}